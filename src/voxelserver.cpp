@@ -1,10 +1,14 @@
 #ifdef _WIN32
 #define WIN32_LEAN_AND_MEAN
 #include <Windows.h>
+#include <intrin.h>
 #else
 #include <unistd.h>
+#include <cpuid.h>
 #endif
 
+#include <immintrin.h>
+
 #include <stdlib.h>
 #include <string>
 #include <iostream>
@@ -14,12 +18,15 @@
 #include <mutex>
 #include <list>
 #include <map>
+#include <bitset>
+#include <unordered_map>
 #include <functional> 
 #include <cctype>
 #include <locale>
 #include <random>
 #include <condition_variable>
 #include <thread>
+#include <memory>
 
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -28,7 +35,11 @@
 #pragma warning(disable:4996 4267)
 
 #include "lasreader.hpp"
+#include "lasreader_las.hpp"
+#include "bytestreamin_array.hpp"
 #include "laswriter.hpp"
+#include "lasindex.hpp"
+#include "lasquadtree.hpp"
 
 #define STB_IMAGE_WRITE_IMPLEMENTATION
 #include "stb/stb_image_write.h"
@@ -88,12 +99,28 @@
 using namespace nanoflann;
 
 typedef double pcln;
+typedef float pcdist;
 typedef Eigen::Vector3d Vec;
 
-//static const int defaultPower = 11;
-static const int defaultPower = 14;
+static const int defaultBoxCacheLimit = 1024;
+static const int defaultBoxDiskLimit = 0;
+static const char* boxDiskRel = "boxes.vxb";
 static const int defaultMapMemoryLimit = 1000;
 static int mapMemoryLimit;
+static const int defaultTreeMemoryLimit = 2000;
+static int treeMemoryLimit;
+static const int defaultReaderNum = 6;
+static int readerNum = defaultReaderNum;
+static const int defaultPointCacheLimit = 256;
+static const int defaultDecodeThreads = 4;
+static const int treeMaxLeaf = 32;
+static const bool defaultUseTrees = true;
+static bool useTrees = defaultUseTrees;
+static int decodeThreads = defaultDecodeThreads;
+static const bool defaultParallelBoxes = true;
+static bool parallelBoxes = defaultParallelBoxes;
+static const int pointCacheCellSize = 64;
+static const uint32_t filterWaveColumnsMin = 64;
 
 static const double defaultTransformThreshold = 500.0;
 static const double defaultTransformScaleBelow = 0.4;
@@ -112,10 +139,14 @@ static const char* fishnetRel = "fishnet/LIDAR_FISHNET_D96.dbf";
 static const char* gkotRel = "laz/gkot";
 static const char* dof84Rel = "dof84";
 static const char* bdmrRel = "bdmr";
+static const char* storeRel = "store/gkot";
 
 static const char* gkotFormat = "{0}/D96TM/TM_{1}.laz";
 static const char* dof84Format = "{0}/{1}.png";
 static const char* bdmrFormat = "{0}/D96TM/TM1_{1}.bin";
+static const char* storeFormat = "{0}/D96TM/TM_{1}.vxp";
+static const char* statsFormat = "{0}/D96TM/TM_{1}.json";
+static const char* treeFormat = "{0}/D96TM/TM_{1}.kdz";
 
 static const int bdmrWidth = 1001;
 static const int bdmrHeight = 1001;
@@ -125,10 +156,15 @@ static const int mapTileHeight = 1000;
 
 static const pcln seaThreshold = 0.1;
 static const pcln waterMaxDepth = 20;
+// Columns further than this from any ground point use the relief model height
+static const int groundFillDistance = 16;
 
 static std::string gkotFullFormat;
 static std::string dof84FullFormat;
 static std::string bdmrFullFormat;
+static std::string storeFullFormat;
+static std::string statsFullFormat;
+static std::string treeFullFormat;
 static std::string webPath;
 static std::string fishnetPath;
 
@@ -665,9 +701,55 @@ ADD_COUNTER(pointsLoaded, "Points loaded");
 ADD_COUNTER(requestsServed, "Requests served");
 ADD_COUNTER(boxesCached, "Boxes cached", RuntimeCounterType::STATP);
 ADD_COUNTER(boxCacheBytes, "Box cache memory", RuntimeCounterType::STATP, RuntimeCounterUnit::BYTES);
+ADD_COUNTER(boxCacheHits, "Box cache hits");
+ADD_COUNTER(boxCacheMisses, "Box cache misses");
+ADD_COUNTER(boxCacheEvictions, "Box cache evictions");
+ADD_COUNTER(boxDiskHits, "Box disk hits");
+ADD_COUNTER(boxDiskMisses, "Box disk misses");
+ADD_COUNTER(boxDiskWrites, "Box disk writes");
+ADD_COUNTER(boxDiskBytes, "Box disk size", RuntimeCounterType::STATP, RuntimeCounterUnit::BYTES);
 ADD_COUNTER(mapOrthoBytes, "Map ortho memory", RuntimeCounterType::STATP, RuntimeCounterUnit::BYTES);
 ADD_COUNTER(mapCloudsInUse, "Map clouds in use", RuntimeCounterType::STATP);
 ADD_COUNTER(mapCloudsLoaded, "Map clouds loaded", RuntimeCounterType::STATP);
+ADD_COUNTER(pointStoresBuilt, "Point stores built");
+ADD_COUNTER(lasIndicesBuilt, "LAS indices built");
+ADD_COUNTER(readersUnindexed, "Readers without LAS index");
+ADD_COUNTER(readerOpens, "Reader opens");
+ADD_COUNTER(readerReuses, "Reader reuses");
+ADD_COUNTER(lidarMappedBytes, "LIDAR mapped memory", RuntimeCounterType::STATP, RuntimeCounterUnit::BYTES);
+ADD_COUNTER(parallelDecodes, "Parallel decodes");
+ADD_COUNTER(sectionsBaked, "Sections baked");
+ADD_COUNTER(treesBuilt, "Section trees built");
+ADD_COUNTER(treeBytes, "Section tree memory", RuntimeCounterType::STATP, RuntimeCounterUnit::BYTES);
+ADD_COUNTER(boxesTreeSearched, "Boxes searched with section trees");
+ADD_COUNTER(boxesMultiTile, "Boxes spanning multiple sections");
+ADD_COUNTER(pointCacheHits, "Point cache hits");
+ADD_COUNTER(pointCacheMisses, "Point cache misses");
+ADD_COUNTER(pointCacheBytes, "Point cache memory", RuntimeCounterType::STATP, RuntimeCounterUnit::BYTES);
+
+/**
+ * Counts of the columns changed by each of the classification filters,
+ * in the same order as the filters.
+ */
+class FilterCounters {
+    std::list<std::string> ids;
+    std::list<std::string> names;
+    std::list<RuntimeCounter> counters;
+
+public:
+    std::vector<RuntimeCounter*> changed;
+
+    FilterCounters()
+    {
+        int index = 0;
+        for (auto &filter : classificationFilters) {
+            ids.push_back("filterChanged" + std::to_string(index++));
+            names.push_back("Columns changed by " + filter.name);
+            counters.emplace_back(ids.back().c_str(), names.back().c_str());
+            changed.push_back(&counters.back());
+        }
+    }
+} filterCounters;
 
 
 
@@ -954,17 +1036,142 @@ bool mkdirp(const char *path)
     std::string copy = path;
     char *p = const_cast<char*>(copy.c_str());
     while (*p) {
-        while (*p && *p != '/') p++;
+        while (*p && *p != '/' && *p != '\\') p++;
         if (!*p) break;
+        char separator = *p;
         *p = 0;
         int ret = _mkdir(copy.c_str());
         if (ret != 0 && errno != EEXIST) return false;
-        *p = '/';
+        *p = separator;
         p++;
     }
     return true;
 }
 
+long long getFileModifiedTime(const char *path)
+{
+    struct stat info;
+    if (stat(path, &info) != 0) return -1;
+    return static_cast<long long>(info.st_mtime);
+}
+
+/**
+ * Fixed set of worker threads used to split the work of a single request.
+ * The calling thread takes part in the work as well, so nested use can't
+ * deadlock even when all the workers are busy.
+ */
+class WorkerPool
+{
+    struct Job
+    {
+        std::function<void(int)> fn;
+        int count;
+        std::atomic<int> next;
+        std::atomic<int> done;
+        std::mutex mutex;
+        std::condition_variable finished;
+
+        // Runs tasks until there are none left
+        void work()
+        {
+            int index;
+            while ((index = next++) < count) {
+                fn(index);
+                if (++done == count) {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    finished.notify_all();
+                }
+            }
+        }
+    };
+
+    std::vector<std::thread> threads;
+    std::list<std::shared_ptr<Job>> jobs;
+    std::mutex mutex;
+    std::condition_variable available;
+    bool stopping;
+
+    void loop()
+    {
+        while (true) {
+            std::shared_ptr<Job> job;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                available.wait(lock, [this] { return stopping || !jobs.empty(); });
+                if (stopping) return;
+                job = jobs.front();
+                jobs.pop_front();
+            }
+            job->work();
+        }
+    }
+
+public:
+    WorkerPool() : stopping(false) {}
+
+    ~WorkerPool()
+    {
+        stop();
+    }
+
+    void start(int num)
+    {
+        for (int i = 0; i < num; i++) {
+            threads.push_back(std::thread(&WorkerPool::loop, this));
+        }
+    }
+
+    void stop()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        available.notify_all();
+        for (auto &thread : threads) thread.join();
+        threads.clear();
+    }
+
+    inline int size() const
+    {
+        return static_cast<int>(threads.size());
+    }
+
+    /**
+     * Calls fn(i) for i in [0, count) spread over the workers and the calling
+     * thread, returning after all the calls are done.
+     */
+    void run(int count, const std::function<void(int)> &fn)
+    {
+        if (count <= 0) return;
+
+        int helpers = std::min(count - 1, size());
+        if (helpers == 0) {
+            for (int i = 0; i < count; i++) fn(i);
+            return;
+        }
+
+        std::shared_ptr<Job> job = std::make_shared<Job>();
+        job->fn = fn;
+        job->count = count;
+        job->next = 0;
+        job->done = 0;
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            for (int i = 0; i < helpers; i++) jobs.push_back(job);
+        }
+        if (helpers == 1) available.notify_one(); else available.notify_all();
+
+        job->work();
+
+        std::unique_lock<std::mutex> lock(job->mutex);
+        job->finished.wait(lock, [&job] { return job->done == job->count; });
+    }
+};
+
+static WorkerPool workers;
+
 /*
 static void tprintf(char str[], const char* format, ...)
 {
@@ -1112,292 +1319,1576 @@ struct Point
 };
 
 
-class PointCloud
+/**
+ * Compact point as stored in a PointCloud, the coordinates are integer
+ * centimeters relative to the origin of the cloud (usually the box corner).
+ */
+struct CloudPoint
 {
-    typedef KDTreeSingleIndexAdaptor<
-        L2_Simple_Adaptor<pcln, PointCloud>, // Distance
-        PointCloud, // Dataset
-        3 // Dimensions
-    > KDTree;
+    int32_t x, y, z;
+    unsigned char classification;
+};
 
-    std::mutex mutex;
+static_assert(sizeof(CloudPoint) <= 16, "CloudPoint should fit into 16 bytes");
 
-public:
-    std::vector<Point> pts;
-    KDTree *tree;
+/**
+ * Size of one CloudPoint coordinate unit in meters.
+ */
+static const pcln cloudPointScale = 0.01;
+static const int cloudPointUnitsPerMeter = 100;
 
-    PointCloud(int maxLeaf) : tree(nullptr) {
-        tree = new KDTree(3, *this, KDTreeSingleIndexAdaptorParams(maxLeaf));
-    }
+/**
+ * Default edge length of the neighbour grid cells in meters. Queries with
+ * a radius up to the cell size look at 27 cells at most.
+ */
+static const pcln pointGridCellSize = 2;
 
-    ~PointCloud() {
-        if (tree) delete tree;
-        tree = nullptr;
-    }
+static inline int floorDiv(const int32_t a, const int32_t b)
+{
+    return a / b - ((a % b != 0) && ((a < 0) != (b < 0)));
+}
 
-    void addPoint(Point &point)
+// Interleaves the low 16 bits of x and y into a Z-order curve index
+static inline unsigned int getMortonCode(int x, int y)
+{
+    unsigned int tmx = x & 0xFFFF;
+    unsigned int tmy = y & 0xFFFF;
+    tmx = (tmx | (tmx << 8)) & 0x00FF00FF;
+    tmx = (tmx | (tmx << 4)) & 0x0F0F0F0F;
+    tmx = (tmx | (tmx << 2)) & 0x33333333;
+    tmx = (tmx | (tmx << 1)) & 0x55555555;
+    tmy = (tmy | (tmy << 8)) & 0x00FF00FF;
+    tmy = (tmy | (tmy << 4)) & 0x0F0F0F0F;
+    tmy = (tmy | (tmy << 2)) & 0x33333333;
+    tmy = (tmy | (tmy << 1)) & 0x55555555;
+    return tmx | (tmy << 1);
+}
+
+/**
+ * Batch of radius queries answered together. Queries run in Z-order of
+ * their centers, so consecutive queries touch mostly the same points, and
+ * share one result buffer instead of allocating per query. Results are in
+ * compressed sparse row form, the results of query i are the range
+ * [offsets[i], offsets[i + 1]) of results, in the order the single query
+ * would return them.
+ */
+class RadiusBatch
+{
+    // Consecutive queries in Z-order answered by one task
+    struct Chunk
     {
-        pts.push_back(point);
-    }
+        std::vector<std::pair<size_t, pcdist>> queryResults;
+        std::vector<std::pair<size_t, pcdist>> results;
+    };
+
+    std::vector<pcln> centers;
+    std::vector<std::pair<unsigned int, uint32_t>> order;
+    std::vector<Chunk> chunks;
+    std::vector<uint32_t> queryChunk;
+    std::vector<uint32_t> chunkStart;
+
+    static const int chunkQueriesMin = 64;
+
+public:
+    // Spread the queries over the workers
+    bool parallel;
+
+    std::vector<uint32_t> offsets;
+    std::vector<std::pair<size_t, pcdist>> results;
 
-    Point& getPoint(size_t index)
+    RadiusBatch() : parallel(false) {}
+
+    void clear()
     {
-        return pts[index];
+        centers.clear();
     }
 
-    inline size_t getPointNum() const
+    // Returns the index of the added query
+    size_t addQuery(const Vec &center)
     {
-        return pts.size();
+        centers.push_back(center.x());
+        centers.push_back(center.y());
+        centers.push_back(center.z());
+        return getQueryNum() - 1;
     }
 
-    void build()
+    inline size_t getQueryNum() const
     {
-        tree->buildIndex();
+        return centers.size() / 3;
     }
 
-    void findRadius(pcln *center, RadiusResultSet<pcln, size_t> &results)
+    inline size_t getResultNum(size_t query) const
     {
-        std::lock_guard<std::mutex> lock(mutex);
-        tree->findNeighbors(results, center, nanoflann::SearchParams(32, 0, false));
+        return offsets[query + 1] - offsets[query];
     }
 
-    bool findNearest(pcln *center, size_t &ret_index, pcln &out_dist_sqr)
+    inline const std::pair<size_t, pcdist>* begin(size_t query) const
     {
-        std::lock_guard<std::mutex> lock(mutex);
-        const int num_results = 1;
-        KNNResultSet<pcln> result(num_results);
-        result.init(&ret_index, &out_dist_sqr);
-        return tree->findNeighbors(result, center, nanoflann::SearchParams());
+        return results.data() + offsets[query];
     }
 
-    // Must return the number of data points
-    inline size_t kdtree_get_point_count() const
+    inline const std::pair<size_t, pcdist>* end(size_t query) const
     {
-        return getPointNum();
+        return results.data() + offsets[query + 1];
     }
 
-    // Returns the distance between the vector "p1[0:size-1]" and the data point with index "idx_p2" stored in the class:
-    inline pcln kdtree_distance(const pcln *p1, const size_t idx_p2, size_t /*size*/) const
+    /**
+     * Returns the end of the results of a query closer than radius, which
+     * are a prefix of its results after sortByDistance.
+     */
+    inline const std::pair<size_t, pcdist>* end(size_t query, pcdist radius) const
     {
-        const Point &p = pts[idx_p2];
-        const pcln d0 = p1[0] - p.x;
-        const pcln d1 = p1[1] - p.y;
-        const pcln d2 = p1[2] - p.z;
-        return d0*d0 + d1*d1 + d2*d2;
+        return std::lower_bound(begin(query), end(query), radius*radius,
+            [](const std::pair<size_t, pcdist> &result, pcdist dist) { return result.second < dist; });
     }
 
-    // Returns the dim'th component of the idx'th point in the class:
-    // Since this is inlined and the "dim" argument is typically an immediate value, the
-    //  "if/else's" are actually solved at compile time.
-    inline pcln kdtree_get_pt(const size_t idx, int dim) const
+    /**
+     * Sorts the results of every query by distance, keeping the order of
+     * results at the same distance.
+     */
+    void sortByDistance()
     {
-        if (dim == 0) return pts[idx].x;
-        else if (dim == 1) return pts[idx].y;
-        else return pts[idx].z;
+        int n = static_cast<int>(getQueryNum());
+        auto sortQuery = [&](int query) {
+            std::stable_sort(results.begin() + offsets[query], results.begin() + offsets[query + 1],
+                [](const std::pair<size_t, pcdist> &a, const std::pair<size_t, pcdist> &b) { return a.second < b.second; });
+        };
+        if (parallel && n >= chunkQueriesMin) {
+            workers.run(n, sortQuery);
+        } else {
+            for (int query = 0; query < n; query++) sortQuery(query);
+        }
     }
 
-    // Optional bounding-box computation: return false to default to a standard bbox computation loop.
-    //   Return true if the BBOX was already computed by the class and returned in "bb" so it can be avoided to redo it again.
-    //   Look at bb.size() to find out the expected dimensionality (e.g. 2 or 3 for point clouds)
-    template <class BBOX>
-    bool kdtree_get_bbox(BBOX& bb) const {
-        return false;
-    }
+    /**
+     * Runs all the queries with the same radius against a search providing
+     * findRadius(center, results), which has to be thread-safe if parallel.
+     */
+    template <typename Search>
+    void run(Search &search, pcdist radius)
+    {
+        size_t n = getQueryNum();
+        offsets.assign(n + 1, 0);
+        results.clear();
+        if (n == 0) return;
+
+        // Z-order of the meter grid relative to the minimum center
+        pcln minX = INFINITY, minY = INFINITY;
+        for (size_t i = 0; i < n; i++) {
+            minX = std::min(minX, centers[i * 3 + 0]);
+            minY = std::min(minY, centers[i * 3 + 1]);
+        }
+        order.resize(n);
+        for (size_t i = 0; i < n; i++) {
+            int mx = static_cast<int>(centers[i * 3 + 0] - minX);
+            int my = static_cast<int>(centers[i * 3 + 1] - minY);
+            order[i] = { getMortonCode(mx, my), static_cast<uint32_t>(i) };
+        }
+        std::sort(order.begin(), order.end());
 
-    template <class BBOX>
-    void kdtree_set_bbox(BBOX& bb) {}
+        int chunkNum = 1;
+        if (parallel) {
+            int chunksMax = static_cast<int>((n + chunkQueriesMin - 1) / chunkQueriesMin);
+            chunkNum = std::max(1, std::min(chunksMax, (workers.size() + 1) * 4));
+        }
+        if (static_cast<int>(chunks.size()) < chunkNum) chunks.resize(chunkNum);
+        queryChunk.resize(n);
+        chunkStart.resize(n);
+
+        const pcdist radiusSqr = radius*radius;
+        auto runChunk = [&](int chunkIndex) {
+            Chunk &chunk = chunks[chunkIndex];
+            chunk.results.clear();
+            size_t from = n * chunkIndex / chunkNum;
+            size_t to = n * (chunkIndex + 1) / chunkNum;
+            for (size_t i = from; i < to; i++) {
+                uint32_t query = order[i].second;
+                RadiusResultSet<pcdist, size_t> set(radiusSqr, chunk.queryResults);
+                search.findRadius(&centers[query * 3], set);
+                queryChunk[query] = chunkIndex;
+                chunkStart[query] = static_cast<uint32_t>(chunk.results.size());
+                offsets[query + 1] = static_cast<uint32_t>(chunk.queryResults.size());
+                chunk.results.insert(chunk.results.end(), chunk.queryResults.begin(), chunk.queryResults.end());
+            }
+        };
+        if (chunkNum > 1) {
+            workers.run(chunkNum, runChunk);
+        } else {
+            runChunk(0);
+        }
 
+        // Back into query order
+        for (size_t i = 0; i < n; i++) offsets[i + 1] += offsets[i];
+        results.resize(offsets[n]);
+        for (size_t i = 0; i < n; i++) {
+            const Chunk &chunk = chunks[queryChunk[i]];
+            std::copy(
+                chunk.results.begin() + chunkStart[i],
+                chunk.results.begin() + chunkStart[i] + getResultNum(i),
+                results.begin() + offsets[i]
+            );
+        }
+    }
 };
 
-class PointCloudIO
+class PointCloud
 {
-    static const int retryNum = 6;
-    static const int retryInitialSleepMs = 10;
-
-    std::mutex mutex;
-    LASreader *reader;
-    bool missing;
-
-    inline bool readPoint(Point &p)
+    // Uniform grid over the bounds of the points, the points are sorted by
+    // cell on build, so each cell is a contiguous range of pts
+    int32_t cellUnits;
+    int32_t gridMin[3];
+    int gridSize[3];
+    std::vector<uint32_t> cellStart;
+
+    inline static int32_t toLocal(const pcln v, const pcln o)
     {
-        if (!reader->read_point()) return false;
+        return static_cast<int32_t>(floor((v - o) * cloudPointUnitsPerMeter + 0.5));
+    }
 
-        LASpoint *point = &reader->point;
-        p.x = point->get_x();
-        p.y = point->get_y();
-        p.z = point->get_z();
-        p.classification = point->classification;
+    inline int getCellIndex(int cx, int cy, int cz) const
+    {
+        return cx + (cy + cz*gridSize[1])*gridSize[0];
+    }
 
-        return true;
+    // Cell coordinate of a search space position along an axis, can be out of the grid
+    inline int getCellCoord(pcdist v, int axis) const
+    {
+        return static_cast<int>(floor(v * cloudPointUnitsPerMeter / cellUnits)) - gridMin[axis];
     }
 
-    inline void transformPoint(Point &p)
+    inline pcdist getDistanceSqr(const pcdist *p1, const CloudPoint &p) const
     {
-        if (p.z <= transformThreshold) {
-            p.z *= transformScaleBelow;
-        } else {
-            p.z = (p.z - transformThreshold) * transformScaleAbove;
-        }
+        const pcdist d0 = p1[0] - p.x * static_cast<pcdist>(cloudPointScale);
+        const pcdist d1 = p1[1] - p.y * static_cast<pcdist>(cloudPointScale);
+        const pcdist d2 = p1[2] - p.z * static_cast<pcdist>(cloudPointScale);
+        return d0*d0 + d1*d1 + d2*d2;
     }
 
 public:
-    PointCloudIO() : reader(nullptr) {}
+    std::vector<CloudPoint> pts;
+    const Vec origin;
 
-    ~PointCloudIO()
-    {
-        close();
-    }
-    
-    void open(const char *path)
+    PointCloud(const Vec &origin = Vec::Zero(), pcln cellSize = pointGridCellSize) :
+        cellUnits(static_cast<int32_t>(cellSize * cloudPointUnitsPerMeter)),
+        origin(origin)
     {
-        int retrySleepMs = retryInitialSleepMs;
-        for (int retries = 0; retries < retryNum && !reader; retries++) {
-            if (retries > 0) {
-                Sleep(retrySleepMs);
-                retrySleepMs *= 2;
-            }
-            LASreadOpener opener = LASreadOpener();
-            opener.set_file_name(path);
-            reader = opener.open();
-            if (!reader) {
-                plog("Unable to open %s, retrying %d more times after %dms", path, retryNum - 1 - retries, retrySleepMs);
-            }
+        for (int i = 0; i < 3; i++) {
+            gridMin[i] = 0;
+            gridSize[i] = 0;
         }
-
-        if (!reader) plog("Unable to open %s after %d retries", path, retryNum);
     }
 
-    void close()
+    inline CloudPoint toLocal(const Point &point) const
     {
-        if (reader) delete reader;
-        reader = nullptr;
+        CloudPoint cp;
+        cp.x = toLocal(point.x, origin.x());
+        cp.y = toLocal(point.y, origin.y());
+        cp.z = toLocal(point.z, origin.z());
+        cp.classification = point.classification;
+        return cp;
     }
 
-    void load(PointCloud *all, PointCloud *ground, double min_x = NAN, double min_y = NAN, double max_x = NAN, double max_y = NAN, bool transform = false)
+    void addPoint(const Point &point)
     {
-        std::lock_guard<std::mutex> lock(mutex);
+        pts.push_back(toLocal(point));
+    }
 
-        if (reader == nullptr) return;
+    inline void addLocalPoint(const CloudPoint &point)
+    {
+        pts.push_back(point);
+    }
 
-        vassert(reader->inside_none(), "Unable to reset LASreader bounds");
-        if (!isnan(min_x) && !isnan(min_y) && !isnan(max_x) && !isnan(max_y)) {
-            vassert(reader->inside_rectangle(min_x, min_y, max_x, max_y), "Unable to set LASreader bounds");
-        }
-        vassert(reader->seek(0), "Unable to seek to start");
-        
+    Point getPoint(size_t index) const
+    {
+        const CloudPoint &cp = pts[index];
         Point p;
-        while (readPoint(p)) {
-            if (transform) transformPoint(p);
-            all->addPoint(p);
-            if (p.classification == Classification::GROUND) ground->addPoint(p);
-        }
-
-        reader->inside_none();
+        p.x = origin.x() + cp.x * cloudPointScale;
+        p.y = origin.y() + cp.y * cloudPointScale;
+        p.z = origin.z() + cp.z * cloudPointScale;
+        p.classification = cp.classification;
+        return p;
     }
-};
-
-template <typename num_t>
-class PointSearch {
-    typedef KDTreeSingleIndexAdaptor<
-        L2_Simple_Adaptor<num_t, PointCloud>, // Distance
-        PointCloud, // Dataset
-        3 // Dimensions
-    > KDTree;
-
-    std::mutex mutex;
-
-    KDTree *tree;
-    int maxLeaf;
-
-    std::string treePath;
 
-public:
-    PointCloud cloud;
+    inline const CloudPoint& getLocalPoint(size_t index) const
+    {
+        return pts[index];
+    }
 
-    PointSearch(const char* pclPath, const char* treePath, int maxLeaf) : cloud(PointCloud(pclPath)), tree(nullptr) {
-        this->maxLeaf = maxLeaf;
-        this->treePath = treePath;
+    inline unsigned char getClassification(size_t index) const
+    {
+        return pts[index].classification;
     }
 
-    ~PointSearch() {
-        deleteTree();
+    inline void setClassification(size_t index, unsigned char classification)
+    {
+        pts[index].classification = classification;
     }
 
-    void deleteTree()
+    inline size_t getPointNum() const
     {
-        if (tree) delete tree;
-        tree = nullptr;
+        return pts.size();
     }
 
-    void loadTree()
+    /**
+     * Appends all the points of another cloud with the same origin.
+     */
+    void append(const PointCloud &other)
     {
-        plogScope();
+        vassert(other.origin == origin, "Point cloud origins should match");
+        pts.insert(pts.end(), other.pts.begin(), other.pts.end());
+    }
 
-        deleteTree();
+    /**
+     * Builds the neighbour grid with a stable counting sort of the points by
+     * cell, starting at point index first. Indices of the points after first
+     * change, so they are invalid after the build. Points before first are
+     * left as they are and are not searched.
+     */
+    void build(size_t first = 0)
+    {
+        size_t n = pts.size();
+        if (first >= n) {
+            for (int i = 0; i < 3; i++) gridSize[i] = 0;
+            cellStart.assign(1, static_cast<uint32_t>(n));
+            return;
+        }
 
-        tree = new KDTree(3, cloud, KDTreeSingleIndexAdaptorParams(maxLeaf));
+        int32_t cellMin[3] = { INT32_MAX, INT32_MAX, INT32_MAX };
+        int32_t cellMax[3] = { INT32_MIN, INT32_MIN, INT32_MIN };
+        for (size_t i = first; i < n; i++) {
+            const CloudPoint &p = pts[i];
+            const int32_t c[3] = { floorDiv(p.x, cellUnits), floorDiv(p.y, cellUnits), floorDiv(p.z, cellUnits) };
+            for (int i = 0; i < 3; i++) {
+                if (c[i] < cellMin[i]) cellMin[i] = c[i];
+                if (c[i] > cellMax[i]) cellMax[i] = c[i];
+            }
+        }
+        for (int i = 0; i < 3; i++) {
+            gridMin[i] = cellMin[i];
+            gridSize[i] = cellMax[i] - cellMin[i] + 1;
+        }
 
-        char treeAllTempPath[1024];
-        TreeIndex ti;
+        size_t cellNum = static_cast<size_t>(gridSize[0]) * gridSize[1] * gridSize[2];
+        cellStart.assign(cellNum + 1, 0);
+        cellStart[0] = static_cast<uint32_t>(first);
+
+        std::vector<uint32_t> pointCells(n - first);
+        for (size_t i = first; i < n; i++) {
+            const CloudPoint &p = pts[i];
+            int cell = getCellIndex(
+                floorDiv(p.x, cellUnits) - gridMin[0],
+                floorDiv(p.y, cellUnits) - gridMin[1],
+                floorDiv(p.z, cellUnits) - gridMin[2]
+            );
+            pointCells[i - first] = cell;
+            cellStart[cell + 1]++;
+        }
+        for (size_t i = 0; i < cellNum; i++) cellStart[i + 1] += cellStart[i];
 
-        if (!ti.begin(treePath.c_str())) {
-            // Index missing
+        std::vector<CloudPoint> sorted(n - first);
+        std::vector<uint32_t> cellFill(cellStart.begin(), cellStart.end() - 1);
+        for (size_t i = first; i < n; i++) {
+            sorted[cellFill[pointCells[i - first]]++ - first] = pts[i];
+        }
+        std::copy(sorted.begin(), sorted.end(), pts.begin() + first);
+    }
 
-            mkdirp(treePath.c_str());
+    /**
+     * Adds all the points closer than the radius of the result set. The
+     * results are in grid order.
+     */
+    void findRadius(const pcln *center, RadiusResultSet<pcdist, size_t> &results)
+    {
+        if (cellStart.size() <= 1) return;
 
-            sprintf_s(treeAllTempPath, "%s.temp", treePath.c_str());
+        pcdist local[3];
+        toSearchSpace(center, local);
 
-            plog("Processing %d points", cloud.kdtree_get_point_count());
-            cloud.preload();
+        const pcdist radiusSqr = results.worstDist();
+        const pcdist radius = sqrt(radiusSqr);
 
-            plog("Building tree index");
+        int lo[3], hi[3];
+        for (int i = 0; i < 3; i++) {
+            lo[i] = std::max(0, getCellCoord(local[i] - radius, i));
+            hi[i] = std::min(gridSize[i] - 1, getCellCoord(local[i] + radius, i));
+            if (lo[i] > hi[i]) return;
+        }
 
-            tree->buildIndex();
+        for (int cz = lo[2]; cz <= hi[2]; cz++) {
+            for (int cy = lo[1]; cy <= hi[1]; cy++) {
+                // Cells along x are contiguous
+                uint32_t start = cellStart[getCellIndex(lo[0], cy, cz)];
+                uint32_t end = cellStart[getCellIndex(hi[0], cy, cz) + 1];
+                for (uint32_t i = start; i < end; i++) {
+                    pcdist dist = getDistanceSqr(local, pts[i]);
+                    if (dist < radiusSqr) results.addPoint(dist, i);
+                }
+            }
+        }
+    }
 
-            cloud.unpreload();
+    void findRadius(RadiusBatch &batch, pcdist radius)
+    {
+        batch.run(*this, radius);
+    }
 
-            plog("Serializing tree index");
+    /**
+     * Finds the closest point by searching growing shells of cells around
+     * the center until no closer point can remain.
+     */
+    bool findNearest(const pcln *center, size_t &ret_index, pcdist &out_dist_sqr)
+    {
+        if (cellStart.size() <= 1) return false;
 
-            ti.writing = true;
-            if (!ti.begin(treeAllTempPath)) {
-                plog("Unable to begin tree index");
-                return;
-            }
+        pcdist local[3];
+        toSearchSpace(center, local);
 
-            tree->saveIndex(treeWriter, &ti);
-        } else {
-            // Index exists
-            tree->loadIndex(treeReader, &ti);
+        int c[3];
+        int maxShell = 0;
+        for (int i = 0; i < 3; i++) {
+            c[i] = getCellCoord(local[i], i);
+            maxShell = std::max(maxShell, std::max(c[i], gridSize[i] - 1 - c[i]));
         }
 
-        if (!ti.end()) {
-            plog("Unable to end tree index");
-            return;
+        const pcdist cellSize = static_cast<pcdist>(cellUnits * cloudPointScale);
+
+        bool found = false;
+        pcdist best = INFINITY;
+        size_t bestIndex = 0;
+
+        for (int shell = 0; shell <= maxShell; shell++) {
+            // Points in this shell or further away are at least this far
+            pcdist bound = (shell - 1) * cellSize;
+            if (found && bound > 0 && best <= bound*bound) break;
+
+            int lo[3], hi[3];
+            bool empty = false;
+            for (int i = 0; i < 3; i++) {
+                lo[i] = std::max(0, c[i] - shell);
+                hi[i] = std::min(gridSize[i] - 1, c[i] + shell);
+                if (lo[i] > hi[i]) empty = true;
+            }
+            if (empty) continue;
+
+            auto searchCells = [&](int cx0, int cx1, int cy, int cz) {
+                uint32_t start = cellStart[getCellIndex(cx0, cy, cz)];
+                uint32_t end = cellStart[getCellIndex(cx1, cy, cz) + 1];
+                for (uint32_t i = start; i < end; i++) {
+                    pcdist dist = getDistanceSqr(local, pts[i]);
+                    if (dist < best) {
+                        best = dist;
+                        bestIndex = i;
+                        found = true;
+                    }
+                }
+            };
+
+            // Only the surface of the shell, the inside was already searched
+            for (int cz = lo[2]; cz <= hi[2]; cz++) {
+                bool zEdge = cz == c[2] - shell || cz == c[2] + shell;
+                for (int cy = lo[1]; cy <= hi[1]; cy++) {
+                    bool yEdge = zEdge || cy == c[1] - shell || cy == c[1] + shell;
+                    if (yEdge) {
+                        searchCells(lo[0], hi[0], cy, cz);
+                    } else {
+                        if (c[0] - shell >= lo[0]) searchCells(c[0] - shell, c[0] - shell, cy, cz);
+                        if (c[0] + shell <= hi[0]) searchCells(c[0] + shell, c[0] + shell, cy, cz);
+                    }
+                }
+            }
         }
 
-        if (ti.writing) {
-            int ret = rename(treeAllTempPath, treePath.c_str());
-            if (ret) plog("Unable to save index, file already exists: %s", treePath.c_str());
+        if (found) {
+            ret_index = bestIndex;
+            out_dist_sqr = best;
         }
+        return found;
     }
 
-    void findRadius(num_t *center, RadiusResultSet<num_t, size_t> &results)
+    // Converts world coordinates to the origin-relative meters the grid works in
+    inline void toSearchSpace(const pcln *center, pcdist *local) const
     {
-        std::lock_guard<std::mutex> lock(mutex);
-        tree->findNeighbors(results, center, nanoflann::SearchParams(32, 0, false));
+        local[0] = static_cast<pcdist>(center[0] - origin.x());
+        local[1] = static_cast<pcdist>(center[1] - origin.y());
+        local[2] = static_cast<pcdist>(center[2] - origin.z());
     }
 
-    bool findNearest(num_t *center, size_t &ret_index, num_t &out_dist_sqr)
-    {
-        std::lock_guard<std::mutex> lock(mutex);
-        const int num_results = 1;
-        KNNResultSet<num_t> result(num_results);
-        result.init(&ret_index, &out_dist_sqr);
-        return tree->findNeighbors(result, center, nanoflann::SearchParams());
-    }
+};
+
+/**
+ * Predicate applied to points while they are loaded, so rejected points are
+ * never passed on. Heights are compared after the transform and ground
+ * points are accepted at any height.
+ */
+struct PointFilter
+{
+    std::bitset<256> classes;
+    pcln zMin;
+    pcln zMax;
+
+    PointFilter() : zMin(-INFINITY), zMax(INFINITY)
+    {
+        classes.set();
+    }
+
+    inline bool acceptsClass(unsigned char classification) const
+    {
+        return classes[classification];
+    }
+
+    inline bool insideHeight(pcln z) const
+    {
+        return z >= zMin && z <= zMax;
+    }
+
+    inline bool acceptsHeight(const Point &p) const
+    {
+        return p.classification == Classification::GROUND || insideHeight(p.z);
+    }
+};
+
+static const PointFilter acceptAll;
+
+/**
+ * Destination of loaded points, called once for every point in the
+ * requested area as it is decoded.
+ */
+class PointSink
+{
+public:
+    virtual ~PointSink() {}
+    virtual void addPoint(const Point &p) = 0;
+
+    // Point coming from a point store, along with its index in the store
+    virtual void addStorePoint(const Point &p, uint32_t /*index*/)
+    {
+        addPoint(p);
+    }
+};
+
+/**
+ * Collects all the points into one cloud and the ground points into
+ * another one, if provided.
+ */
+class CloudSink : public PointSink
+{
+    PointCloud *all;
+    PointCloud *ground;
+
+public:
+    CloudSink(PointCloud *all, PointCloud *ground = nullptr) : all(all), ground(ground) {}
+
+    void addPoint(const Point &p) override
+    {
+        all->addPoint(p);
+        if (ground && p.classification == Classification::GROUND) ground->addPoint(p);
+    }
+};
+
+/**
+ * Decoded points of one pointCacheCellSize square of a section, relative to
+ * the cell corner.
+ */
+struct PointCacheCell
+{
+    Vec origin;
+    std::vector<CloudPoint> pts;
+};
+
+/**
+ * Byte limited LRU cache of decoded section cells, so that neighbouring
+ * boxes don't have to decode the same LIDAR region again.
+ */
+class PointCache
+{
+public:
+    typedef std::shared_ptr<const PointCacheCell> CellRef;
+
+private:
+    struct Entry
+    {
+        uint64_t key;
+        CellRef cell;
+        size_t bytes;
+    };
+
+    std::mutex mutex;
+    std::list<Entry> entries;
+    std::unordered_map<uint64_t, std::list<Entry>::iterator> index;
+    size_t bytes;
+    size_t limit;
+
+    void evict()
+    {
+        while (bytes > limit && !entries.empty()) {
+            Entry &entry = entries.back();
+            bytes -= entry.bytes;
+            pointCacheBytes -= entry.bytes;
+            index.erase(entry.key);
+            entries.pop_back();
+        }
+    }
+
+public:
+    PointCache() : bytes(0), limit(0) {}
+
+    static uint64_t getKey(int lat, int lon, int cx, int cy)
+    {
+        return
+            (static_cast<uint64_t>(static_cast<uint16_t>(lat)) << 48) |
+            (static_cast<uint64_t>(static_cast<uint16_t>(lon)) << 32) |
+            (static_cast<uint64_t>(static_cast<uint16_t>(cx)) << 16) |
+            (static_cast<uint64_t>(static_cast<uint16_t>(cy)));
+    }
+
+    void setLimit(size_t limitBytes)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        limit = limitBytes;
+        evict();
+    }
+
+    bool isEnabled() const
+    {
+        return limit > 0;
+    }
+
+    CellRef get(uint64_t key)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = index.find(key);
+        if (it == index.end()) {
+            ++pointCacheMisses;
+            return nullptr;
+        }
+        ++pointCacheHits;
+        entries.splice(entries.begin(), entries, it->second);
+        return it->second->cell;
+    }
+
+    void put(uint64_t key, CellRef cell)
+    {
+        size_t cellBytes = sizeof(PointCacheCell) + cell->pts.size() * sizeof(CloudPoint);
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = index.find(key);
+        if (it != index.end()) {
+            // Decoded concurrently by another request, keep the existing one
+            entries.splice(entries.begin(), entries, it->second);
+            return;
+        }
+        entries.push_front(Entry{ key, cell, cellBytes });
+        index[key] = entries.begin();
+        bytes += cellBytes;
+        pointCacheBytes += cellBytes;
+        evict();
+    }
+};
+
+static PointCache pointCache;
+
+static inline void transformPoint(Point &p)
+{
+    if (p.z <= transformThreshold) {
+        p.z *= transformScaleBelow;
+    } else {
+        p.z = (p.z - transformThreshold) * transformScaleAbove;
+    }
+}
+
+/**
+ * LAS reader decoding straight from a memory-mapped file, so all the readers
+ * of a section share the same pages without their own file buffers.
+ */
+class LASreaderLASMapped : public LASreaderLAS
+{
+public:
+    BOOL open(char *data, size_t size)
+    {
+        U8 *bytes = reinterpret_cast<U8*>(data);
+        I64 length = static_cast<I64>(size);
+        ByteStreamIn *stream;
+        if (IS_LITTLE_ENDIAN()) stream = new ByteStreamInArrayLE(bytes, length);
+        else stream = new ByteStreamInArrayBE(bytes, length);
+        return LASreaderLAS::open(stream);
+    }
+};
+
+class PointCloudIO
+{
+    static const int retryNum = 6;
+    static const int retryInitialSleepMs = 10;
+
+    std::mutex mutex;
+    LASreader *reader;
+    bool missing;
+
+    // Reads the next point, skipping the ones with classes rejected by the filter
+    inline bool readPoint(Point &p, const PointFilter &filter)
+    {
+        LASpoint *point = &reader->point;
+        do {
+            if (!reader->read_point()) return false;
+        } while (!filter.acceptsClass(point->classification));
+
+        p.x = point->get_x();
+        p.y = point->get_y();
+        p.z = point->get_z();
+        p.classification = point->classification;
+
+        return true;
+    }
+
+public:
+    PointCloudIO() : reader(nullptr) {}
+
+    ~PointCloudIO()
+    {
+        close();
+    }
+
+    bool isOpen() const
+    {
+        return reader != nullptr;
+    }
+
+    /**
+     * Opens the LAS file at path, decoding from the mapped contents of the
+     * file instead if provided.
+     */
+    void open(const char *path, char *mapped = nullptr, size_t mappedSize = 0)
+    {
+        if (reader) {
+            ++readerReuses;
+            return;
+        }
+
+        ++readerOpens;
+
+        int retrySleepMs = retryInitialSleepMs;
+        for (int retries = 0; retries < retryNum && !reader; retries++) {
+            if (retries > 0) {
+                Sleep(retrySleepMs);
+                retrySleepMs *= 2;
+            }
+            if (mapped) {
+                reader = openMapped(path, mapped, mappedSize);
+            } else {
+                LASreadOpener opener = LASreadOpener();
+                opener.set_file_name(path);
+                reader = opener.open();
+            }
+            if (!reader) {
+                plog("Unable to open %s, retrying %d more times after %dms", path, retryNum - 1 - retries, retrySleepMs);
+            }
+        }
+
+        if (!reader) {
+            plog("Unable to open %s after %d retries", path, retryNum);
+            return;
+        }
+
+        // Without an index rectangle reads decode the whole tile
+        if (!reader->get_index()) {
+            static std::atomic<bool> warned(false);
+            if (!warned.exchange(true)) plog("LAS index missing for %s, build it with --index", path);
+            ++readersUnindexed;
+        }
+    }
+
+    void close()
+    {
+        if (reader) delete reader;
+        reader = nullptr;
+    }
+
+    static LASreader* openMapped(const char *path, char *mapped, size_t mappedSize)
+    {
+        LASreaderLASMapped *lasreader = new LASreaderLASMapped();
+        if (!lasreader->open(mapped, mappedSize)) {
+            delete lasreader;
+            return nullptr;
+        }
+
+        // Same as LASreadOpener, the index is looked up next to the file
+        LASindex *index = new LASindex();
+        if (index->read(path)) {
+            lasreader->set_index(index);
+        } else {
+            delete index;
+        }
+
+        return lasreader;
+    }
+
+    /**
+     * Fills in the point index ranges (inclusive) the spatial index returns
+     * for the rectangle, split at compression chunk boundaries so each range
+     * can be decoded independently. Returns false without an index.
+     */
+    bool getRanges(double min_x, double min_y, double max_x, double max_y, std::vector<std::pair<uint32_t, uint32_t>> &ranges)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+
+        if (reader == nullptr) return false;
+        LASindex *index = reader->get_index();
+        if (!index) return false;
+
+        // Variable or unknown chunking falls back to the default chunk size
+        uint32_t chunkSize = 50000;
+        LASzip *laszip = reader->header.laszip;
+        if (laszip && laszip->chunk_size > 0 && laszip->chunk_size != U32_MAX) chunkSize = laszip->chunk_size;
+
+        ranges.clear();
+        index->intersect_rectangle(min_x, min_y, max_x, max_y);
+        while (index->has_intervals()) {
+            uint32_t start = index->start;
+            uint32_t end = index->end;
+            while (start <= end) {
+                uint32_t chunkEnd = (start / chunkSize + 1) * chunkSize - 1;
+                uint32_t rangeEnd = std::min(chunkEnd, end);
+                ranges.push_back(std::make_pair(start, rangeEnd));
+                start = rangeEnd + 1;
+            }
+        }
+        return true;
+    }
+
+    /**
+     * Reads the points in the index range [start, end] that fall inside the
+     * rectangle.
+     */
+    void loadRange(std::vector<Point> &points, uint32_t start, uint32_t end, double min_x, double min_y, double max_x, double max_y, bool transform = false, const PointFilter &filter = acceptAll)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+
+        if (reader == nullptr) return;
+
+        vassert(reader->inside_none(), "Unable to reset LASreader bounds");
+        vassert(reader->seek(start), "Unable to seek to %u", start);
+
+        LASpoint *point = &reader->point;
+        Point p;
+        for (uint32_t i = start; i <= end; i++) {
+            if (!reader->read_point()) break;
+            if (!filter.acceptsClass(point->classification)) continue;
+            p.x = point->get_x();
+            p.y = point->get_y();
+            // Same bounds test as LASpoint::inside_rectangle
+            if (p.x < min_x || p.x >= max_x || p.y < min_y || p.y >= max_y) continue;
+            p.z = point->get_z();
+            p.classification = point->classification;
+            if (transform) transformPoint(p);
+            if (!filter.acceptsHeight(p)) continue;
+            points.push_back(p);
+        }
+    }
+
+    void load(PointSink &sink, double min_x = NAN, double min_y = NAN, double max_x = NAN, double max_y = NAN, bool transform = false, const PointFilter &filter = acceptAll)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+
+        if (reader == nullptr) return;
+
+        vassert(reader->inside_none(), "Unable to reset LASreader bounds");
+        if (!isnan(min_x) && !isnan(min_y) && !isnan(max_x) && !isnan(max_y)) {
+            vassert(reader->inside_rectangle(min_x, min_y, max_x, max_y), "Unable to set LASreader bounds");
+        }
+        vassert(reader->seek(0), "Unable to seek to start");
+        
+        Point p;
+        while (readPoint(p, filter)) {
+            if (transform) transformPoint(p);
+            if (!filter.acceptsHeight(p)) continue;
+            sink.addPoint(p);
+        }
+
+        reader->inside_none();
+    }
+};
+
+// Finest quadtree cell size and the point count below which cells get merged
+static const float lasIndexCellSize = 10.0f;
+static const int lasIndexThreshold = 1000;
+static const int lasIndexMinimumPoints = 10000;
+
+// LASindex reads and writes the .lax next to the .las/.laz file it indexes
+static std::string getLasIndexPath(const std::string &lidarPath)
+{
+    std::string path = lidarPath;
+    path[path.size() - 1] = path[path.size() - 1] == 'Z' || path[path.size() - 1] == 'S' ? 'X' : 'x';
+    return path;
+}
+
+static bool buildLasIndex(const char *lidarPath)
+{
+    plogScope();
+    dtimer("las index build");
+
+    LASreadOpener opener = LASreadOpener();
+    opener.set_file_name(lidarPath);
+    LASreader *reader = opener.open();
+    if (!reader) {
+        plog("Unable to open %s", lidarPath);
+        return false;
+    }
+
+    LASquadtree *quadtree = new LASquadtree;
+    quadtree->setup(reader->header.min_x, reader->header.max_x, reader->header.min_y, reader->header.max_y, lasIndexCellSize);
+
+    LASindex index;
+    index.prepare(quadtree, lasIndexThreshold);
+    while (reader->read_point()) {
+        index.add(reader->point.get_x(), reader->point.get_y(), (U32)(reader->p_count - 1));
+    }
+
+    reader->close();
+    delete reader;
+
+    index.complete(lasIndexMinimumPoints, -1, FALSE);
+
+    // Write next to a temporary name first, so readers never see a partial index
+    std::string lidar = lidarPath;
+    std::string extension = lidar.substr(lidar.size() - 4);
+    std::string tempLidar = lidar.substr(0, lidar.size() - 4) + ".temp" + extension;
+    std::string tempPath = getLasIndexPath(tempLidar);
+    std::string path = getLasIndexPath(lidar);
+
+    bool ok = index.write(tempLidar.c_str()) == TRUE;
+    if (ok) {
+        remove(path.c_str());
+        ok = rename(tempPath.c_str(), path.c_str()) == 0;
+    }
+    if (!ok) {
+        plog("Unable to save LAS index %s", path.c_str());
+        remove(tempPath.c_str());
+        return false;
+    }
+
+    ++lasIndicesBuilt;
+    return true;
+}
+
+/**
+ * Decoded columnar copy of a LIDAR tile, converted once from the LAZ source
+ * and memory-mapped afterwards. Points are sorted into square cells of
+ * `cellSize` meters, so a rectangle query only touches the cells overlapping
+ * it and reads the coordinates straight from the mapping.
+ *
+ * Layout: header, cell start offsets (cells + 1), X, Y, Z (int32 in LAS
+ * units), classification (uint8). Points keep their file order within a cell.
+ */
+class PointStore
+{
+    static const uint32_t version = 1;
+    static const int cellSize = 16;
+
+    struct Header
+    {
+        char magic[4];
+        uint32_t version;
+        uint64_t pointNum;
+        double scale[3];
+        double offset[3];
+        double minX, minY;
+        uint32_t cellsX, cellsY;
+    };
+
+    char *mapped;
+    size_t mappedSize;
+
+    const Header *header;
+    const uint32_t *cellStart;
+    const int32_t *px;
+    const int32_t *py;
+    const int32_t *pz;
+    const uint8_t *pc;
+
+    static size_t align(size_t offset)
+    {
+        return (offset + 7) & ~static_cast<size_t>(7);
+    }
+
+    // Offsets of the sections following the header, last one is the total size
+    static void getLayout(const Header &h, size_t (&offsets)[6])
+    {
+        size_t cells = (size_t)h.cellsX*h.cellsY + 1;
+        size_t n = (size_t)h.pointNum;
+        offsets[0] = align(sizeof(Header));
+        offsets[1] = align(offsets[0] + cells * sizeof(uint32_t));
+        offsets[2] = align(offsets[1] + n * sizeof(int32_t));
+        offsets[3] = align(offsets[2] + n * sizeof(int32_t));
+        offsets[4] = align(offsets[3] + n * sizeof(int32_t));
+        offsets[5] = offsets[4] + n * sizeof(uint8_t);
+    }
+
+    static int getCell(double v, double min, uint32_t cells)
+    {
+        int c = static_cast<int>(floor((v - min) / cellSize));
+        return c < 0 ? 0 : c >= (int)cells ? cells - 1 : c;
+    }
+
+    static bool writeSection(FILE *file, const void *data, size_t size, size_t &written)
+    {
+        static const char padding[8] = {};
+        size_t pad = align(written) - written;
+        if (pad > 0 && fwrite(padding, 1, pad, file) != pad) return false;
+        if (size > 0 && fwrite(data, 1, size, file) != size) return false;
+        written += pad + size;
+        return true;
+    }
+
+public:
+    PointStore() : mapped(nullptr), mappedSize(0), header(nullptr) {}
+
+    ~PointStore()
+    {
+        close();
+    }
+
+    bool isOpen() const
+    {
+        return header != nullptr;
+    }
+
+    size_t getPointNum() const
+    {
+        return header ? (size_t)header->pointNum : 0;
+    }
+
+    /**
+     * Decodes the whole LAZ tile at `lidarPath` and writes it out as a point
+     * store at `storePath` (via a temporary file, so readers never see a
+     * partially written store).
+     */
+    static bool build(const char *lidarPath, const char *storePath)
+    {
+        plogScope();
+        dtimer("point store build");
+
+        LASreadOpener opener = LASreadOpener();
+        opener.set_file_name(lidarPath);
+        LASreader *reader = opener.open();
+        if (!reader) {
+            plog("Unable to open %s", lidarPath);
+            return false;
+        }
+
+        Header h;
+        memcpy(h.magic, "VXPS", sizeof(h.magic));
+        h.version = version;
+        h.scale[0] = reader->header.x_scale_factor;
+        h.scale[1] = reader->header.y_scale_factor;
+        h.scale[2] = reader->header.z_scale_factor;
+        h.offset[0] = reader->header.x_offset;
+        h.offset[1] = reader->header.y_offset;
+        h.offset[2] = reader->header.z_offset;
+        h.minX = floor(reader->header.min_x);
+        h.minY = floor(reader->header.min_y);
+        h.cellsX = std::max(1, (int)ceil((reader->header.max_x - h.minX) / cellSize));
+        h.cellsY = std::max(1, (int)ceil((reader->header.max_y - h.minY) / cellSize));
+
+        size_t cellNum = (size_t)h.cellsX*h.cellsY;
+
+        std::vector<int32_t> fx, fy, fz;
+        std::vector<uint8_t> fc;
+        std::vector<uint32_t> fcell;
+        size_t reserve = (size_t)reader->npoints;
+        fx.reserve(reserve); fy.reserve(reserve); fz.reserve(reserve);
+        fc.reserve(reserve); fcell.reserve(reserve);
+
+        std::vector<uint32_t> cellStart(cellNum + 1, 0);
+
+        while (reader->read_point()) {
+            const LASpoint &point = reader->point;
+            int cx = getCell(point.get_x(), h.minX, h.cellsX);
+            int cy = getCell(point.get_y(), h.minY, h.cellsY);
+            uint32_t cell = cx + cy*h.cellsX;
+            fx.push_back(point.get_X());
+            fy.push_back(point.get_Y());
+            fz.push_back(point.get_Z());
+            fc.push_back(point.classification);
+            fcell.push_back(cell);
+            cellStart[cell + 1]++;
+        }
+
+        reader->close();
+        delete reader;
+
+        size_t n = fx.size();
+        h.pointNum = n;
+
+        // Stable counting sort by cell
+        for (size_t i = 0; i < cellNum; i++) cellStart[i + 1] += cellStart[i];
+
+        std::vector<int32_t> sx(n), sy(n), sz(n);
+        std::vector<uint8_t> sc(n);
+        {
+            std::vector<uint32_t> cellFill(cellStart.begin(), cellStart.end() - 1);
+            for (size_t i = 0; i < n; i++) {
+                uint32_t target = cellFill[fcell[i]]++;
+                sx[target] = fx[i];
+                sy[target] = fy[i];
+                sz[target] = fz[i];
+                sc[target] = fc[i];
+            }
+        }
+
+        if (!mkdirp(storePath)) {
+            plog("Unable to create directory for %s", storePath);
+            return false;
+        }
+
+        std::ostringstream tempStream;
+        tempStream << storePath << "." << std::hash<std::thread::id>()(std::this_thread::get_id()) << ".temp";
+        std::string tempPath = tempStream.str();
+
+        FILE *file = fopen(tempPath.c_str(), "wb");
+        if (!file) {
+            plog("Unable to write %s", tempPath.c_str());
+            return false;
+        }
+
+        size_t written = 0;
+        bool ok =
+            writeSection(file, &h, sizeof(h), written) &&
+            writeSection(file, cellStart.data(), cellStart.size() * sizeof(uint32_t), written) &&
+            writeSection(file, sx.data(), n * sizeof(int32_t), written) &&
+            writeSection(file, sy.data(), n * sizeof(int32_t), written) &&
+            writeSection(file, sz.data(), n * sizeof(int32_t), written) &&
+            writeSection(file, sc.data(), n * sizeof(uint8_t), written);
+
+        if (fclose(file) != 0) ok = false;
+
+        if (ok) {
+            remove(storePath);
+            ok = rename(tempPath.c_str(), storePath) == 0;
+        }
+
+        if (!ok) {
+            plog("Unable to save point store %s", storePath);
+            remove(tempPath.c_str());
+            return false;
+        }
+
+        ++pointStoresBuilt;
+        plog("Point store %s built with %zd points", storePath, n);
+
+        return true;
+    }
+
+    static bool isStale(const char *lidarPath, const char *storePath)
+    {
+        long long storeTime = getFileModifiedTime(storePath);
+        return storeTime == -1 || storeTime < getFileModifiedTime(lidarPath);
+    }
+
+    bool open(const char *storePath)
+    {
+        close();
+
+        mapped = map_file(storePath, &mappedSize);
+        if (!mapped) return false;
+
+        const Header *h = reinterpret_cast<const Header*>(mapped);
+        size_t offsets[6];
+        bool valid = mappedSize >= sizeof(Header) &&
+            memcmp(h->magic, "VXPS", sizeof(h->magic)) == 0 &&
+            h->version == version;
+        if (valid) {
+            getLayout(*h, offsets);
+            valid = offsets[5] == mappedSize;
+        }
+        if (!valid) {
+            plog("Invalid point store %s", storePath);
+            close();
+            return false;
+        }
+
+        header = h;
+        cellStart = reinterpret_cast<const uint32_t*>(mapped + offsets[0]);
+        px = reinterpret_cast<const int32_t*>(mapped + offsets[1]);
+        py = reinterpret_cast<const int32_t*>(mapped + offsets[2]);
+        pz = reinterpret_cast<const int32_t*>(mapped + offsets[3]);
+        pc = reinterpret_cast<const uint8_t*>(mapped + offsets[4]);
+
+        return true;
+    }
+
+    void close()
+    {
+        if (mapped) unmap_file(mapped, mappedSize);
+        mapped = nullptr;
+        mappedSize = 0;
+        header = nullptr;
+    }
+
+    void load(PointSink &sink, double min_x = NAN, double min_y = NAN, double max_x = NAN, double max_y = NAN, bool transform = false, const PointFilter &filter = acceptAll) const
+    {
+        if (!header) return;
+
+        bool bounded = !isnan(min_x) && !isnan(min_y) && !isnan(max_x) && !isnan(max_y);
+
+        int cx0 = 0, cy0 = 0;
+        int cx1 = header->cellsX - 1, cy1 = header->cellsY - 1;
+        if (bounded) {
+            cx0 = getCell(min_x, header->minX, header->cellsX);
+            cy0 = getCell(min_y, header->minY, header->cellsY);
+            cx1 = getCell(max_x, header->minX, header->cellsX);
+            cy1 = getCell(max_y, header->minY, header->cellsY);
+        }
+
+        const double *scale = header->scale;
+        const double *offset = header->offset;
+
+        Point p;
+        for (int cy = cy0; cy <= cy1; cy++) {
+            for (int cx = cx0; cx <= cx1; cx++) {
+                uint32_t cell = cx + cy*header->cellsX;
+                uint32_t end = cellStart[cell + 1];
+                for (uint32_t i = cellStart[cell]; i < end; i++) {
+                    if (!filter.acceptsClass(pc[i])) continue;
+                    // Same bounds test as LASpoint::inside_rectangle
+                    p.x = scale[0]*px[i] + offset[0];
+                    if (bounded && (p.x < min_x || p.x >= max_x)) continue;
+                    p.y = scale[1]*py[i] + offset[1];
+                    if (bounded && (p.y < min_y || p.y >= max_y)) continue;
+                    p.z = scale[2]*pz[i] + offset[2];
+                    p.classification = pc[i];
+                    if (transform) transformPoint(p);
+                    if (!filter.acceptsHeight(p)) continue;
+                    sink.addStorePoint(p, i);
+                }
+            }
+        }
+    }
+
+    inline const int32_t* getCoords(int dim) const
+    {
+        return dim == 0 ? px : dim == 1 ? py : pz;
+    }
+
+    inline double getScale(int dim) const
+    {
+        return header->scale[dim];
+    }
+
+    inline double getOffset(int dim) const
+    {
+        return header->offset[dim];
+    }
+
+    inline double getMinX() const
+    {
+        return header->minX;
+    }
+
+    inline double getMinY() const
+    {
+        return header->minY;
+    }
+};
+
+/**
+ * Sequential access to a tree index file for the nanoflann save and load
+ * callbacks. Reading goes through a memory mapping of the file.
+ */
+struct TreeIndex
+{
+    bool writing;
+    bool failed;
+    FILE *file;
+    char *mapped;
+    size_t mappedSize;
+    size_t offset;
+
+    TreeIndex() : writing(false), failed(false), file(nullptr), mapped(nullptr), mappedSize(0), offset(0) {}
+
+    bool begin(const char *path)
+    {
+        failed = false;
+        offset = 0;
+        if (writing) {
+            file = fopen(path, "wb");
+            return file != nullptr;
+        }
+        mapped = map_file(path, &mappedSize);
+        return mapped != nullptr;
+    }
+
+    bool end()
+    {
+        if (file) {
+            if (fclose(file) != 0) failed = true;
+            file = nullptr;
+        }
+        if (mapped) {
+            unmap_file(mapped, mappedSize);
+            mapped = nullptr;
+            mappedSize = 0;
+        }
+        return !failed;
+    }
+};
+
+static void treeWriter(const void *ptr, size_t size, size_t count, void *userdata)
+{
+    TreeIndex *ti = static_cast<TreeIndex*>(userdata);
+    if (ti->failed) return;
+    if (fwrite(ptr, size, count, ti->file) != count) ti->failed = true;
+}
+
+static size_t treeReader(const void *ptr, size_t size, size_t count, void *userdata)
+{
+    TreeIndex *ti = static_cast<TreeIndex*>(userdata);
+    size_t bytes = size*count;
+    if (ti->failed || ti->offset + bytes > ti->mappedSize) {
+        ti->failed = true;
+        memset(const_cast<void*>(ptr), 0, bytes);
+        return 0;
+    }
+    memcpy(const_cast<void*>(ptr), ti->mapped + ti->offset, bytes);
+    ti->offset += bytes;
+    return count;
+}
+
+/**
+ * Persisted kd-tree over the points of a point store. The tree is built
+ * once per section by bake and saved next to the store, the server only
+ * loads it.
+ * Coordinates are relative to the store corner to keep float precision.
+ */
+template <typename num_t>
+class PointSearch {
+    typedef KDTreeSingleIndexAdaptor<
+        L2_Simple_Adaptor<num_t, PointSearch<num_t> >, // Distance
+        PointSearch<num_t>, // Dataset
+        3, // Dimensions
+        uint32_t // Index
+    > KDTree;
+
+    static const uint32_t version = 1;
+
+    struct Header
+    {
+        char magic[4];
+        uint32_t version;
+        uint64_t pointNum;
+        uint32_t maxLeaf;
+        uint32_t numSize;
+    };
+
+    const PointStore &store;
+    KDTree *tree;
+    int maxLeaf;
+    size_t memory;
+
+    std::string treePath;
+
+    const int32_t *coords[3];
+    double scale[3];
+    double base[3];
+
+public:
+    Vec origin;
+
+    PointSearch(const PointStore &store, const char* treePath, int maxLeaf) : store(store), tree(nullptr), memory(0) {
+        this->maxLeaf = maxLeaf;
+        this->treePath = treePath;
+        origin = Vec(store.getMinX(), store.getMinY(), 0);
+        for (int i = 0; i < 3; i++) {
+            coords[i] = store.getCoords(i);
+            scale[i] = store.getScale(i);
+            base[i] = store.getOffset(i) - origin[i];
+        }
+    }
+
+    ~PointSearch() {
+        deleteTree();
+    }
+
+    static bool isStale(const char *storePath, const char *treePath)
+    {
+        long long treeTime = getFileModifiedTime(treePath);
+        return treeTime == -1 || treeTime < getFileModifiedTime(storePath);
+    }
+
+    bool isLoaded() const
+    {
+        return tree != nullptr;
+    }
+
+    void deleteTree()
+    {
+        if (tree) delete tree;
+        tree = nullptr;
+        treeBytes -= memory;
+        memory = 0;
+    }
+
+    // Reads and checks the header at the start of the tree index
+    bool readHeader(TreeIndex &ti) const
+    {
+        Header h;
+        treeReader(&h, sizeof(h), 1, &ti);
+        return !ti.failed &&
+            strncmp(h.magic, "VXKD", 4) == 0 &&
+            h.version == version &&
+            h.pointNum == store.getPointNum() &&
+            h.maxLeaf == static_cast<uint32_t>(maxLeaf) &&
+            h.numSize == sizeof(num_t);
+    }
+
+    /**
+     * Returns true if the tree path holds a tree matching the store.
+     */
+    bool hasTree() const
+    {
+        if (!store.isOpen()) return false;
+        TreeIndex ti;
+        if (!ti.begin(treePath.c_str())) return false;
+        bool valid = readHeader(ti);
+        ti.end();
+        return valid;
+    }
+
+    /**
+     * Loads the tree from the tree path. Trees are only built by buildTree
+     * during bake, so a missing or invalid tree is not loaded.
+     */
+    bool loadTree()
+    {
+        plogScope();
+
+        deleteTree();
+
+        if (!store.isOpen()) return false;
+
+        TreeIndex ti;
+        if (!ti.begin(treePath.c_str())) return false;
+
+        tree = new KDTree(3, *this, KDTreeSingleIndexAdaptorParams(maxLeaf));
+
+        bool loaded = false;
+        if (readHeader(ti)) {
+            tree->loadIndex(treeReader, &ti);
+            loaded = !ti.failed;
+        }
+        ti.end();
+
+        if (!loaded) {
+            plog("Invalid tree index %s, run bake to rebuild it", treePath.c_str());
+            deleteTree();
+            return false;
+        }
+
+        // Nodes live in the tree pool, the point indices in its own vector
+        memory = tree->usedMemory();
+        treeBytes += memory;
+
+        return true;
+    }
+
+    /**
+     * Builds the tree and saves it to the tree path.
+     */
+    bool buildTree()
+    {
+        plogScope();
+
+        deleteTree();
+
+        if (!store.isOpen()) return false;
+
+        tree = new KDTree(3, *this, KDTreeSingleIndexAdaptorParams(maxLeaf));
+
+        std::string treeTempPath = treePath + ".temp";
+
+        if (!mkdirp(treePath.c_str())) {
+            plog("Unable to create directory for %s", treePath.c_str());
+        }
+
+        plog("Building tree index of %zd points", store.getPointNum());
+
+        {
+            dtimer("section tree build");
+            tree->buildIndex();
+        }
+
+        plog("Serializing tree index");
+
+        Header h;
+        memcpy(h.magic, "VXKD", 4);
+        h.version = version;
+        h.pointNum = store.getPointNum();
+        h.maxLeaf = maxLeaf;
+        h.numSize = sizeof(num_t);
+
+        TreeIndex ti;
+        ti.writing = true;
+        if (!ti.begin(treeTempPath.c_str())) {
+            plog("Unable to begin tree index %s", treeTempPath.c_str());
+            return false;
+        }
+
+        treeWriter(&h, sizeof(h), 1, &ti);
+        tree->saveIndex(treeWriter, &ti);
+
+        bool ok = ti.end();
+        if (ok) {
+            remove(treePath.c_str());
+            ok = rename(treeTempPath.c_str(), treePath.c_str()) == 0;
+        }
+        if (!ok) {
+            plog("Unable to save tree index %s", treePath.c_str());
+            remove(treeTempPath.c_str());
+            return false;
+        }
+
+        ++treesBuilt;
+        return true;
+    }
+
+    // Finds the points closer than the radius of the result set around the world coordinates
+    void findRadius(const pcln *center, RadiusResultSet<num_t, uint32_t> &results) const
+    {
+        num_t local[3];
+        for (int i = 0; i < 3; i++) local[i] = static_cast<num_t>(center[i] - origin[i]);
+        tree->findNeighbors(results, local, nanoflann::SearchParams(32, 0, false));
+    }
+
+    // Must return the number of data points
+    inline size_t kdtree_get_point_count() const
+    {
+        return store.getPointNum();
+    }
+
+    // Returns the distance between the vector "p1[0:size-1]" and the data point with index "idx_p2" stored in the class:
+    inline num_t kdtree_distance(const num_t *p1, const size_t idx_p2, size_t /*size*/) const
+    {
+        const num_t d0 = p1[0] - kdtree_get_pt(idx_p2, 0);
+        const num_t d1 = p1[1] - kdtree_get_pt(idx_p2, 1);
+        const num_t d2 = p1[2] - kdtree_get_pt(idx_p2, 2);
+        return d0*d0 + d1*d1 + d2*d2;
+    }
+
+    // Returns the dim'th component of the idx'th point in the class
+    inline num_t kdtree_get_pt(const size_t idx, int dim) const
+    {
+        return static_cast<num_t>(coords[dim][idx] * scale[dim] + base[dim]);
+    }
+
+    template <class BBOX>
+    bool kdtree_get_bbox(BBOX& bb) const {
+        return false;
+    }
+
+    template <class BBOX>
+    void kdtree_set_bbox(BBOX& bb) {}
 
 };
 
+typedef PointSearch<pcdist> SectionSearch;
+
 static const long boxHashAccessStart = 0xFF;
 static std::atomic<long> boxHashAccess = { boxHashAccessStart };
 static const long long mapCloudAccessStart = 0xFF;
@@ -1406,6 +2897,211 @@ static std::atomic<long long> mapCloudAccess = { mapCloudAccessStart };
 class MapCloud;
 struct MapCloudRef;
 
+/**
+ * Lookup cubes from map pixel colors quantized to 6 bits per channel to
+ * the specialized classification, one for every LiDAR classification with
+ * a specialization and one for the rest. A cell only holds a classification
+ * if every color in it is closest to the same classificationMap entry,
+ * otherwise it holds `mixed` and the color needs the full search.
+ */
+class ClassificationCubes
+{
+    static const int bits = 6;
+    static const int size = 1 << bits;
+    static const int shift = 8 - bits;
+
+    // Cube of every LiDAR classification
+    uint8_t cubeIndex[256];
+    std::vector<std::vector<uint8_t>> cubes;
+
+    // Bit field of every cube in a packed pixel, holding the index of the
+    // classification in the classes the cube can give
+    struct Field
+    {
+        int shift;
+        int mask;
+        std::vector<Classification> classes;
+    };
+    std::vector<Field> fields;
+    int packedBits;
+
+    void addField(const std::list<Classification> *specializesTo)
+    {
+        Field field;
+        for (auto &iter : classificationMap) {
+            if (specializesTo && std::find(specializesTo->begin(), specializesTo->end(), iter.second) == specializesTo->end()) continue;
+            if (std::find(field.classes.begin(), field.classes.end(), iter.second) != field.classes.end()) continue;
+            field.classes.push_back(iter.second);
+        }
+        if (field.classes.empty()) field.classes.push_back(Classification::NONE);
+
+        int bits = 0;
+        while ((1 << bits) < static_cast<int>(field.classes.size())) bits++;
+        field.shift = packedBits;
+        field.mask = (1 << bits) - 1;
+        packedBits += bits;
+        fields.push_back(field);
+    }
+
+    void buildCube(const std::list<Classification> *specializesTo, std::vector<uint8_t> &cube)
+    {
+        struct Entry
+        {
+            int r, g, b;
+            Classification classification;
+        };
+        std::vector<Entry> entries;
+        for (auto &iter : classificationMap) {
+            if (specializesTo && std::find(specializesTo->begin(), specializesTo->end(), iter.second) == specializesTo->end()) continue;
+            Entry entry;
+            rgbToComponents(iter.first, entry.r, entry.g, entry.b);
+            entry.classification = iter.second;
+            entries.push_back(entry);
+        }
+
+        // Closest entry at the cell corners, with the same tie breaking as
+        // the full search. The colors closest to an entry form a convex
+        // region, so a cell with the same entry at all corners is all of it.
+        const int lattice = size + 1;
+        const uint8_t noEntry = 0xFF;
+        std::vector<uint8_t> closest(lattice*lattice*lattice);
+        auto closestPlane = [&](int lr) {
+            for (int lg = 0; lg < lattice; lg++) {
+                for (int lb = 0; lb < lattice; lb++) {
+                    int tr = lr << shift;
+                    int tg = lg << shift;
+                    int tb = lb << shift;
+                    long minDist = MAXLONG;
+                    uint8_t minEntry = noEntry;
+                    for (size_t i = 0; i < entries.size(); i++) {
+                        int dr = entries[i].r - tr;
+                        int dg = entries[i].g - tg;
+                        int db = entries[i].b - tb;
+                        long dist = dr*dr + dg*dg + db*db;
+                        if (dist < minDist) {
+                            minDist = dist;
+                            minEntry = static_cast<uint8_t>(i);
+                        }
+                    }
+                    closest[(lr*lattice + lg)*lattice + lb] = minEntry;
+                }
+            }
+        };
+        workers.run(lattice, closestPlane);
+
+        cube.resize(size*size*size);
+        for (int r = 0; r < size; r++) {
+            for (int g = 0; g < size; g++) {
+                for (int b = 0; b < size; b++) {
+                    uint8_t entry = closest[(r*lattice + g)*lattice + b];
+                    bool same = true;
+                    for (int corner = 1; corner < 8 && same; corner++) {
+                        int cr = r + (corner & 1);
+                        int cg = g + ((corner >> 1) & 1);
+                        int cb = b + ((corner >> 2) & 1);
+                        same = closest[(cr*lattice + cg)*lattice + cb] == entry;
+                    }
+                    uint8_t c = mixed;
+                    if (same) c = entry == noEntry ? Classification::NONE : entries[entry].classification;
+                    cube[(r*size + g)*size + b] = c;
+                }
+            }
+        }
+    }
+
+public:
+    static const uint8_t mixed = 0xFF;
+
+    ClassificationCubes() : packedBits(0)
+    {
+        std::vector<const std::list<Classification>*> cubeSpecs;
+        cubeSpecs.push_back(nullptr);
+        std::fill(std::begin(cubeIndex), std::end(cubeIndex), 0);
+        for (auto &spec : classificationSpec) {
+            // Classifications with the same specialization share a cube
+            size_t index;
+            for (index = 1; index < cubeSpecs.size(); index++) {
+                if (*cubeSpecs[index] == spec.second) break;
+            }
+            if (index == cubeSpecs.size()) cubeSpecs.push_back(&spec.second);
+            cubeIndex[spec.first] = static_cast<uint8_t>(index);
+        }
+
+        cubes.resize(cubeSpecs.size());
+        for (size_t i = 0; i < cubeSpecs.size(); i++) {
+            buildCube(cubeSpecs[i], cubes[i]);
+            addField(cubeSpecs[i]);
+        }
+    }
+
+    inline uint8_t get(Classification lidar, unsigned int rgb) const
+    {
+        int r = ((rgb >> 16) & 0xFF) >> shift;
+        int g = ((rgb >> 8) & 0xFF) >> shift;
+        int b = (rgb & 0xFF) >> shift;
+        return cubes[cubeIndex[lidar & 0xFF]][(r*size + g)*size + b];
+    }
+
+    inline int getCubeNum() const
+    {
+        return static_cast<int>(cubes.size());
+    }
+
+    inline int getCubeIndex(Classification lidar) const
+    {
+        return cubeIndex[lidar & 0xFF];
+    }
+
+    // True if the specialized classifications of all cubes fit in a byte
+    inline bool isPackable() const
+    {
+        return packedBits <= 8;
+    }
+
+    inline uint8_t pack(int cube, Classification c) const
+    {
+        const Field &field = fields[cube];
+        auto it = std::find(field.classes.begin(), field.classes.end(), c);
+        vassert(it != field.classes.end(), "Classification %d not in cube %d", c, cube);
+        return static_cast<uint8_t>((it - field.classes.begin()) << field.shift);
+    }
+
+    inline Classification unpack(Classification lidar, uint8_t packed) const
+    {
+        const Field &field = fields[cubeIndex[lidar & 0xFF]];
+        return field.classes[(packed >> field.shift) & field.mask];
+    }
+};
+
+/**
+ * Returns the classification cubes of the classification tables, built on
+ * first use. The tables are constant, so the cubes never change.
+ */
+static const ClassificationCubes* getClassificationCubes()
+{
+    static const ClassificationCubes cubes;
+    return &cubes;
+}
+
+static inline void combineStamp(uint64_t &stamp, uint64_t value)
+{
+    stamp ^= value + 0x9e3779b97f4a7c15ULL + (stamp << 6) + (stamp >> 2);
+}
+
+/**
+ * Stamp of the files a section is generated from, it changes whenever any
+ * of them is modified, created or removed.
+ */
+static uint64_t getSectionStamp(const std::string &lidarPath, const std::string &storePath, const std::string &mapPath, const std::string &bdmrPath)
+{
+    uint64_t stamp = 0;
+    combineStamp(stamp, static_cast<uint64_t>(getFileModifiedTime(lidarPath.c_str())));
+    combineStamp(stamp, static_cast<uint64_t>(getFileModifiedTime(storePath.c_str())));
+    combineStamp(stamp, static_cast<uint64_t>(getFileModifiedTime(mapPath.c_str())));
+    combineStamp(stamp, static_cast<uint64_t>(getFileModifiedTime(bdmrPath.c_str())));
+    return stamp;
+}
+
 struct ClassificationQuery {
     double x;
     double y;
@@ -1418,20 +3114,35 @@ struct ClassificationQuery {
 
 class MapCloud {
 public:
-    static const int READER_NUM = 6;
     const int lat;
     const int lon;
 
-    bool readerFree[READER_NUM];
-    PointCloudIO readers[READER_NUM];
-    int readersFree = READER_NUM;
+    // Readers stay open for the lifetime of the map cloud and get reset per load
+    const int readerNum;
+    std::vector<bool> readerFree;
+    std::vector<PointCloudIO> readers;
+    int readersFree;
 
     int32_t* bdmrMap;
     size_t bdmrSize;
 
+    PointStore store;
+
+    // Persisted neighbour tree over the store points, null if unavailable
+    SectionSearch *search;
+
+    // LIDAR file shared by all the readers if there is no point store
+    char* lidarMapped;
+    size_t lidarMappedSize;
+
+    // Section files stamp from when the cloud was loaded
+    const uint64_t sourceStamp;
+
 protected:
     const std::string lidarPath;
     const std::string mapPath;
+    const std::string storePath;
+    const std::string treePath;
 
     std::mutex mutex;
     std::condition_variable cond;
@@ -1439,45 +3150,185 @@ protected:
     std::atomic<long long> access;
     std::atomic<int> references;
 
+    // The ortho photo is only loaded for requests that need the colors
+    // themselves and is kept until the map cloud is deleted
+    std::mutex mapMutex;
+    std::atomic<bool> mapLoaded;
     MapImage map;
+    int mapWidth;
+    int mapHeight;
+
+    // Packed specialized classifications of every map pixel, see
+    // ClassificationCubes::pack, empty if they don't fit in a byte
+    std::vector<uint8_t> specialized;
+
+    void loadMapImage(MapImage &image) {
+        dtimer("mapcloud map image");
+
+        int reqComp = 3;
+        int retComp;
+        image.data = stbi_load(mapPath.c_str(), &image.width, &image.height, &retComp, reqComp);
+        if (image.data == nullptr) {
+            plog("Unable to open %s", mapPath.c_str());
+            image.width = image.height = 0;
+        } else {
+            assert(reqComp == retComp);
+            image.size = image.width*image.height*retComp;
+            mapOrthoBytes += image.size;
+        }
+    }
+
+    void loadMap() {
+        std::lock_guard<std::mutex> lock(mapMutex);
+        if (mapLoaded) return;
+        loadMapImage(map);
+        mapLoaded.store(true, std::memory_order_release);
+    }
+
+    void releaseMap() {
+        std::lock_guard<std::mutex> lock(mapMutex);
+        if (map.data) {
+            stbi_image_free(map.data);
+            mapOrthoBytes -= map.size;
+            map.data = nullptr;
+        }
+        mapLoaded.store(false, std::memory_order_release);
+    }
+
+    inline void requireMap() {
+        if (!mapLoaded.load(std::memory_order_acquire)) loadMap();
+    }
+
+    /**
+     * Classifies every map pixel for each LiDAR specialization at once,
+     * voting over the neighbourhood of large classifications like
+     * getSpecializedClassification used to do per query.
+     */
+    void buildSpecialized(const ClassificationCubes *cubes) {
+        dtimer("mapcloud specialized raster");
+
+        // Classify a private copy of the ortho photo unless it's loaded
+        // already, so the shared one is never freed under its readers
+        MapImage privateMap;
+        const MapImage *image = &map;
+        if (!mapLoaded.load(std::memory_order_acquire)) {
+            loadMapImage(privateMap);
+            image = &privateMap;
+        }
+        mapWidth = std::max(1, image->width);
+        mapHeight = std::max(1, image->height);
+
+        const int pixelNum = mapWidth*mapHeight;
+        const int cubeNum = cubes->getCubeNum();
+
+        // Any LiDAR classification of each cube
+        std::vector<Classification> cubeLidar(cubeNum, Classification::NONE);
+        std::vector<bool> cubeFound(cubeNum, false);
+        for (int i = 0; i < 256; i++) {
+            int cube = cubes->getCubeIndex(static_cast<Classification>(i));
+            if (cubeFound[cube]) continue;
+            cubeFound[cube] = true;
+            cubeLidar[cube] = static_cast<Classification>(i);
+        }
+
+        std::vector<uint8_t> classes(pixelNum);
+        std::vector<uint8_t> packed(pixelNum, 0);
+        for (int cube = 0; cube < cubeNum; cube++) {
+            ClassificationQuery cq;
+            cq.lidar = cubeLidar[cube];
+
+            workers.run(mapHeight, [&](int my) {
+                for (int mx = 0; mx < mapWidth; mx++) {
+                    classes[mx + my*mapWidth] = static_cast<uint8_t>(classifyPixel(cq, getImagePointColor(*image, mx, my)));
+                }
+            });
+
+            auto classify = [&](int mx, int my) {
+                mx = std::max(0, std::min(mapWidth - 1, mx));
+                my = std::max(0, std::min(mapHeight - 1, my));
+                return static_cast<Classification>(classes[mx + my*mapWidth]);
+            };
+            workers.run(mapHeight, [&](int my) {
+                for (int mx = 0; mx < mapWidth; mx++) {
+                    packed[mx + my*mapWidth] |= cubes->pack(cube, specializePixel(mx, my, classify));
+                }
+            });
+        }
+
+        if (privateMap.data) {
+            stbi_image_free(privateMap.data);
+            mapOrthoBytes -= privateMap.size;
+            privateMap.data = nullptr;
+        }
+
+        mapOrthoBytes += pixelNum;
+        specialized.swap(packed);
+    }
 
 public:
 
-    MapCloud(int lat, int lon, std::string lidarPath, std::string mapPath, std::string bdmrPath) :
+    MapCloud(int lat, int lon, std::string lidarPath, std::string mapPath, std::string bdmrPath, std::string storePath, std::string treePath) :
         lat(lat), lon(lon),
-        lidarPath(lidarPath),
-        mapPath(mapPath),
+        readerNum(::readerNum),
+        readerFree(readerNum, true),
+        readers(readerNum),
+        readersFree(readerNum),
         bdmrMap(nullptr),
         bdmrSize(0),
-        references(0)
+        search(nullptr),
+        lidarMapped(nullptr),
+        lidarMappedSize(0),
+        sourceStamp(getSectionStamp(lidarPath, storePath, mapPath, bdmrPath)),
+        lidarPath(lidarPath),
+        mapPath(mapPath),
+        storePath(storePath),
+        treePath(treePath),
+        references(0),
+        mapLoaded(false),
+        mapWidth(1),
+        mapHeight(1)
     {
         ++mapCloudsLoaded;
 
         plogScope();
 
         {
-            dtimer("mapcloud readers");
-            for (int i = 0; i < READER_NUM; i++) {
-                readerFree[i] = true;
+            dtimer("mapcloud point store");
+            // Stores are only built by bake, a missing or outdated one is
+            // served from the LIDAR file until then
+            bool stale = PointStore::isStale(lidarPath.c_str(), storePath.c_str());
+            if (stale || !store.open(storePath.c_str())) {
+                plog("Point store %s, reading %s directly", stale ? "missing or outdated" : "unavailable", lidarPath.c_str());
+                lidarMapped = map_file(lidarPath.c_str(), &lidarMappedSize);
+                if (lidarMapped) {
+                    lidarMappedBytes += lidarMappedSize;
+                } else {
+                    lidarMappedSize = 0;
+                }
             }
         }
 
-        {
-            dtimer("mapcloud map image");
-
-            int reqComp = 3;
-            int retComp;
-            map.data = stbi_load(mapPath.c_str(), &map.width, &map.height, &retComp, reqComp);
-            map.size = map.width*map.height*retComp;
-            mapOrthoBytes += map.size;
-            if (map.data == nullptr) {
-                plog("Unable to open %s", mapPath.c_str());
-            }
-            else {
-                assert(reqComp == retComp);
+        if (useTrees && store.isOpen()) {
+            dtimer("mapcloud tree");
+            if (SectionSearch::isStale(storePath.c_str(), treePath.c_str())) {
+                plog("Section tree %s missing or outdated, searching the grid until it is baked", treePath.c_str());
+            } else {
+                search = new SectionSearch(store, treePath.c_str(), treeMaxLeaf);
+                if (!search->loadTree()) {
+                    delete search;
+                    search = nullptr;
+                }
             }
         }
 
+        const ClassificationCubes *cubes = getClassificationCubes();
+        if (cubes->isPackable()) {
+            buildSpecialized(cubes);
+        } else {
+            plog("Specialized classifications do not fit in a byte, keeping the ortho photo");
+            loadMap();
+        }
+
         {
             dtimer("mapcloud bdmr map");
             size_t length;
@@ -1501,17 +3352,25 @@ public:
     ~MapCloud() {
         --mapCloudsLoaded;
 
-        for (int i = 0; i < READER_NUM; i++) {
+        for (int i = 0; i < readerNum; i++) {
             readerFree[i] = false;
             readers[i].close();
         }
 
-        if (map.data) {
-            stbi_image_free(map.data);
-            mapOrthoBytes -= map.size;
-            map.data = nullptr;
+        if (search) {
+            delete search;
+            search = nullptr;
         }
 
+        if (lidarMapped) {
+            unmap_file(lidarMapped, lidarMappedSize);
+            lidarMappedBytes -= lidarMappedSize;
+            lidarMapped = nullptr;
+        }
+
+        releaseMap();
+        mapOrthoBytes -= specialized.size();
+
         if (bdmrMap != nullptr) {
             unmap_file(reinterpret_cast<char*>(bdmrMap), bdmrSize);
             bdmrMap = nullptr;
@@ -1526,6 +3385,10 @@ public:
         return access;
     }
 
+    const SectionSearch* getSearch() const {
+        return search;
+    }
+
     void acquire() {
         std::unique_lock<std::mutex> lock(mutex);
         ++mapCloudsInUse;
@@ -1533,45 +3396,194 @@ public:
         access = mapCloudAccess++;
     }
 
-    void release() {
-        std::unique_lock<std::mutex> lock(mutex);
-        --mapCloudsInUse;
-        --references;
-        access = mapCloudAccess++;
+    void release() {
+        std::unique_lock<std::mutex> lock(mutex);
+        --mapCloudsInUse;
+        --references;
+        access = mapCloudAccess++;
+    }
+
+    void load(PointCloud *all, PointCloud *ground, double min_x = NAN, double min_y = NAN, double max_x = NAN, double max_y = NAN, bool transform = false) {
+        CloudSink sink(all, ground);
+        load(sink, min_x, min_y, max_x, max_y, transform);
+    }
+
+    void load(PointSink &sink, double min_x = NAN, double min_y = NAN, double max_x = NAN, double max_y = NAN, bool transform = false, const PointFilter &filter = acceptAll) {
+        if (store.isOpen()) {
+            store.load(sink, min_x, min_y, max_x, max_y, transform, filter);
+            return;
+        }
+
+        bool bounded = !isnan(min_x) && !isnan(min_y) && !isnan(max_x) && !isnan(max_y);
+        if (bounded && pointCache.isEnabled()) {
+            loadCached(sink, min_x, min_y, max_x, max_y, transform, filter);
+            return;
+        }
+
+        loadReader(sink, min_x, min_y, max_x, max_y, transform, filter);
+    }
+
+protected:
+    /**
+     * Loads the rectangle from decoded point cache cells, decoding the
+     * missing cells with a reader.
+     */
+    void loadCached(PointSink &sink, double min_x, double min_y, double max_x, double max_y, bool transform, const PointFilter &filter) {
+        const int cx0 = static_cast<int>(floor(min_x / pointCacheCellSize));
+        const int cy0 = static_cast<int>(floor(min_y / pointCacheCellSize));
+        const int cx1 = static_cast<int>(floor(max_x / pointCacheCellSize));
+        const int cy1 = static_cast<int>(floor(max_y / pointCacheCellSize));
+
+        // Smallest coordinate in cell units that is not below the bound
+        auto toUnits = [](double v, double origin) {
+            return static_cast<int64_t>(ceil((v - origin) * cloudPointUnitsPerMeter - 1e-6));
+        };
+
+        for (int cy = cy0; cy <= cy1; cy++) {
+            for (int cx = cx0; cx <= cx1; cx++) {
+                uint64_t key = PointCache::getKey(lat, lon, cx, cy);
+                PointCache::CellRef cell = pointCache.get(key);
+                if (!cell) {
+                    Vec origin(cx * pointCacheCellSize, cy * pointCacheCellSize, 0);
+                    PointCloud decoded(origin);
+                    CloudSink decodedSink(&decoded);
+                    loadReader(decodedSink,
+                        origin.x(), origin.y(),
+                        origin.x() + pointCacheCellSize, origin.y() + pointCacheCellSize
+                    );
+                    std::shared_ptr<PointCacheCell> created = std::make_shared<PointCacheCell>();
+                    created->origin = origin;
+                    created->pts.swap(decoded.pts);
+                    pointCache.put(key, created);
+                    cell = created;
+                }
+
+                const Vec &origin = cell->origin;
+                const int64_t ux0 = toUnits(min_x, origin.x());
+                const int64_t uy0 = toUnits(min_y, origin.y());
+                const int64_t ux1 = toUnits(max_x, origin.x());
+                const int64_t uy1 = toUnits(max_y, origin.y());
+
+                Point p;
+                for (const CloudPoint &cp : cell->pts) {
+                    if (!filter.acceptsClass(cp.classification)) continue;
+                    if (cp.x < ux0 || cp.x >= ux1 || cp.y < uy0 || cp.y >= uy1) continue;
+                    p.x = origin.x() + cp.x * cloudPointScale;
+                    p.y = origin.y() + cp.y * cloudPointScale;
+                    p.z = origin.z() + cp.z * cloudPointScale;
+                    p.classification = cp.classification;
+                    if (transform) transformPoint(p);
+                    if (!filter.acceptsHeight(p)) continue;
+                    sink.addPoint(p);
+                }
+            }
+        }
+    }
+
+    /**
+     * Returns the index of a free reader, waiting for one if wait is set or
+     * returning -1 otherwise.
+     */
+    int acquireReader(bool wait) {
+        std::unique_lock<std::mutex> lock(mutex);
+        if (!wait && readersFree == 0) return -1;
+        while (readersFree == 0) cond.wait(lock);
+        int readerIndex = -1;
+        for (int i = 0; i < readerNum; i++) {
+            if (!readerFree[i]) continue;
+            readerIndex = i;
+            readerFree[readerIndex] = false;
+            break;
+        }
+        vassert(readerIndex > -1, "Unable to find free reader");
+        readersFree--;
+        return readerIndex;
+    }
+
+    void releaseReader(int readerIndex) {
+        std::unique_lock<std::mutex> lock(mutex);
+        readerFree[readerIndex] = true;
+        readersFree++;
+        cond.notify_one();
+    }
+
+    void loadReader(PointSink &sink, double min_x = NAN, double min_y = NAN, double max_x = NAN, double max_y = NAN, bool transform = false, const PointFilter &filter = acceptAll) {
+        int readerIndex = acquireReader(true);
+        PointCloudIO *reader = &readers[readerIndex];
+
+        reader->open(lidarPath.c_str(), lidarMapped, lidarMappedSize);
+
+        bool bounded = !isnan(min_x) && !isnan(min_y) && !isnan(max_x) && !isnan(max_y);
+        std::vector<std::pair<uint32_t, uint32_t>> ranges;
+        if (decodeThreads > 1 && bounded &&
+            reader->getRanges(min_x, min_y, max_x, max_y, ranges) &&
+            ranges.size() > 1) {
+            loadParallel(sink, readerIndex, ranges, min_x, min_y, max_x, max_y, transform, filter);
+        } else {
+            reader->load(sink, min_x, min_y, max_x, max_y, transform, filter);
+        }
+
+        releaseReader(readerIndex);
     }
 
-    void load(PointCloud *all, PointCloud *ground, double min_x = NAN, double min_y = NAN, double max_x = NAN, double max_y = NAN, bool transform = false) {
-        int readerIndex = -1;
-        PointCloudIO *reader;
+    /**
+     * Decodes the chunk ranges with as many readers as are free (up to
+     * decodeThreads), each into its own buffer, and passes the points on in
+     * range order, the same order a single reader would produce.
+     */
+    void loadParallel(PointSink &sink, int readerIndex, const std::vector<std::pair<uint32_t, uint32_t>> &ranges, double min_x, double min_y, double max_x, double max_y, bool transform, const PointFilter &filter) {
+        // Only the first reader is waited for, so concurrent loads can't
+        // deadlock each other
+        std::vector<int> readerIndices;
+        readerIndices.push_back(readerIndex);
+        int maxReaders = std::min(decodeThreads, static_cast<int>(ranges.size()));
+        while (static_cast<int>(readerIndices.size()) < maxReaders) {
+            int extra = acquireReader(false);
+            if (extra < 0) break;
+            readerIndices.push_back(extra);
+        }
 
-        {
-            std::unique_lock<std::mutex> lock(mutex);
-            while (readersFree == 0) cond.wait(lock);
-            for (int i = 0; i < READER_NUM; i++) {
-                if (!readerFree[i]) continue;
-                readerIndex = i;
-                readerFree[readerIndex] = false;
-                reader = &readers[readerIndex];
-                break;
-            }
-            vassert(readerIndex > -1, "Unable to find free reader");
-            readersFree--;
+        int groupNum = static_cast<int>(readerIndices.size());
+
+        // Split the ranges into contiguous groups of about the same size
+        uint64_t total = 0;
+        for (auto &range : ranges) total += range.second - range.first + 1;
+        std::vector<size_t> groupStart(groupNum + 1, ranges.size());
+        groupStart[0] = 0;
+        uint64_t sum = 0;
+        int group = 1;
+        for (size_t i = 0; i < ranges.size() && group < groupNum; i++) {
+            sum += ranges[i].second - ranges[i].first + 1;
+            if (sum * groupNum >= total * group) groupStart[group++] = i + 1;
         }
 
-        reader->open(lidarPath.c_str());
-        reader->load(all, ground, min_x, min_y, max_x, max_y, transform);
-        reader->close();
+        if (groupNum > 1) ++parallelDecodes;
 
-        {
-            std::unique_lock<std::mutex> lock(mutex);
-            readerFree[readerIndex] = true;
-            reader = nullptr;
-            readersFree++;
-            cond.notify_one();
+        std::vector<std::vector<Point>> buffers(groupNum);
+        workers.run(groupNum, [&](int g) {
+            PointCloudIO *groupReader = &readers[readerIndices[g]];
+            groupReader->open(lidarPath.c_str(), lidarMapped, lidarMappedSize);
+            for (size_t i = groupStart[g]; i < groupStart[g + 1]; i++) {
+                groupReader->loadRange(buffers[g], ranges[i].first, ranges[i].second, min_x, min_y, max_x, max_y, transform, filter);
+            }
+        });
+
+        for (int g = 1; g < groupNum; g++) releaseReader(readerIndices[g]);
+
+        for (auto &buffer : buffers) {
+            for (const Point &p : buffer) sink.addPoint(p);
         }
     }
 
+public:
     static Classification classifyPixel(const ClassificationQuery &cq, unsigned int rgb) {
+        uint8_t c = getClassificationCubes()->get(cq.lidar, rgb);
+        if (c != ClassificationCubes::mixed) return static_cast<Classification>(c);
+        return classifyPixelNearest(cq, rgb);
+    }
+
+    // Full nearest color search of classifyPixel
+    static Classification classifyPixelNearest(const ClassificationQuery &cq, unsigned int rgb) {
         int tr, tg, tb;
 
         rgbToComponents(rgb, tr, tg, tb);
@@ -1623,6 +3635,7 @@ public:
     }
 
     const MapImage& getMap() {
+        requireMap();
         return map;
     }
 
@@ -1650,17 +3663,22 @@ public:
         return mapCloud->getMapPointColor(mx, my);
     }
 
-    unsigned int getMapPointColor(int mx, int my) const {
+    unsigned int getMapPointColor(int mx, int my) {
+        requireMap();
+        return getImagePointColor(map, mx, my);
+    }
+
+    static unsigned int getImagePointColor(const MapImage &image, int mx, int my) {
         if (mx < 0) mx = 0;
         if (my < 0) my = 0;
-        if (mx >= map.width - 1) mx = map.width - 1;
-        if (my >= map.height - 1) my = map.height - 1;
+        if (mx >= image.width - 1) mx = image.width - 1;
+        if (my >= image.height - 1) my = image.height - 1;
 
-        if (map.data == nullptr) return 0;
+        if (image.data == nullptr) return 0;
 
-        unsigned char* md = static_cast<unsigned char*>(map.data);
+        unsigned char* md = static_cast<unsigned char*>(image.data);
 
-        int mapIndex = (mx + my * map.width) * 3;
+        int mapIndex = (mx + my * image.width) * 3;
         return (md[mapIndex + 0] << 16) | (md[mapIndex + 1] << 8) | md[mapIndex + 2];
     }
 
@@ -1688,10 +3706,9 @@ public:
         return bdmrMap[mapIndex] / (pcln)100;
     }
 
-    Classification getMapPointClassification(const ClassificationQuery &cq, int mx, int my) {
-        unsigned int pixel = getMapPointColor(mx, my);
-        return classifyPixel(cq, pixel);
-    }
+    // Pixel step and range of the neighbourhood large classifications are voted over
+    static const int largeStep = 3;
+    static const int largeRange = 2;
 
     static Classification getSpecializedClassification(const ClassificationQuery &cq, MapCloud** cloudOut = nullptr, int* mapX = nullptr, int* mapY = nullptr) {
 
@@ -1706,14 +3723,38 @@ public:
         if (mapY) *mapY = my;
         if (!mapCloud) return Classification::NONE;
 
-        Classification center = mapCloud->getMapPointClassification(cq, mx, my);
+        return mapCloud->getSpecializedPixel(cq, mx, my);
+    }
+
+    Classification getSpecializedPixel(const ClassificationQuery &cq, int mx, int my) {
+        if (specialized.empty()) {
+            auto classify = [this, &cq](int x, int y) {
+                return classifyPixel(cq, getMapPointColor(x, y));
+            };
+            return specializePixel(mx, my, classify);
+        }
+
+        mx = std::max(0, std::min(mapWidth - 1, mx));
+        my = std::max(0, std::min(mapHeight - 1, my));
+        return getClassificationCubes()->unpack(cq.lidar, specialized[mx + my*mapWidth]);
+    }
+
+    /**
+     * Specialized classification of a map pixel, with the map pixels
+     * classified by classify(mx, my). Large classifications are voted over
+     * the pixels around them.
+     */
+    template <typename PixelClassifier>
+    static Classification specializePixel(int mx, int my, PixelClassifier &classify) {
+
+        Classification center = classify(mx, my);
 
         int flags = 0;
         auto foundFlags = classificationFlags.find(center);
         if (foundFlags != classificationFlags.end()) flags = foundFlags->second;
         
-        const int step = (flags & ClassificationFlags::LARGE) ? 3 : 1;
-        const int range = (flags & ClassificationFlags::LARGE) ? 2 : 0;
+        const int step = (flags & ClassificationFlags::LARGE) ? largeStep : 1;
+        const int range = (flags & ClassificationFlags::LARGE) ? largeRange : 0;
 
         if (range > 0) {
             int counts[Classification::END] = {};
@@ -1722,7 +3763,7 @@ public:
                     if (ox == 0 && oy == 0) continue;
                     int omx = mx + ox*step;
                     int omy = my + oy*step;
-                    Classification c = mapCloud->getMapPointClassification(cq, omx, omy);
+                    Classification c = classify(omx, omy);
                     counts[c]++;
                 }
             }
@@ -1777,17 +3818,7 @@ struct SpatialHash
 
     T& at(int x, int y, unsigned int &hashCode)
     {
-        unsigned int tmx = x & 0xFFFF;
-        unsigned int tmy = y & 0xFFFF;
-        tmx = (tmx | (tmx << 8)) & 0x00FF00FF;
-        tmx = (tmx | (tmx << 4)) & 0x0F0F0F0F;
-        tmx = (tmx | (tmx << 2)) & 0x33333333;
-        tmx = (tmx | (tmx << 1)) & 0x55555555;
-        tmy = (tmy | (tmy << 8)) & 0x00FF00FF;
-        tmy = (tmy | (tmy << 4)) & 0x0F0F0F0F;
-        tmy = (tmy | (tmy << 2)) & 0x33333333;
-        tmy = (tmy | (tmy << 1)) & 0x55555555;
-        unsigned int coordHash = tmx | (tmy << 1);
+        unsigned int coordHash = getMortonCode(x, y);
         hashCode = coordHash & mask;
 
         
@@ -1853,8 +3884,9 @@ static void trimMapCloudList()
     int sleepMs = sleepMin;
 
     long long mapMemoryLimitBytes = mapMemoryLimit * 1000000L;
+    long long treeMemoryLimitBytes = treeMemoryLimit * 1000000L;
 
-    while (mapOrthoBytes.load() > mapMemoryLimitBytes) {
+    while (mapOrthoBytes.load() > mapMemoryLimitBytes || treeBytes.load() > treeMemoryLimitBytes) {
         MapCloud* lru = nullptr;
         long long minAccessTime = MAXLONGLONG;
         for (auto i = mapCloudList.begin(); i != mapCloudList.end(); i++) {
@@ -1931,6 +3963,134 @@ static unsigned int classificationToBlock(unsigned int cv)
     return (blocklight << 16) | bv;
 }
 
+/**
+ * Maps a row of block classifications to blocks through a table and sets
+ * the height of every block that is not air to y. Returns true if any block
+ * in the row is not air.
+ */
+typedef bool (*BlockRowKernel)(const uint8_t *classes, int n, const unsigned int *table, unsigned int *blocks, int y, int *heights);
+
+#ifdef _MSC_VER
+#define TARGET_SSE41
+#define TARGET_AVX2
+#else
+#define TARGET_SSE41 __attribute__((target("sse4.1")))
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+
+static bool mapBlockRowScalar(const uint8_t *classes, int n, const unsigned int *table, unsigned int *blocks, int y, int *heights)
+{
+    bool any = false;
+    for (int i = 0; i < n; i++) {
+        unsigned int bv = table[classes[i]];
+        blocks[i] = bv;
+        if (bv) {
+            heights[i] = y;
+            any = true;
+        }
+    }
+    return any;
+}
+
+TARGET_SSE41 static bool mapBlockRowSse41(const uint8_t *classes, int n, const unsigned int *table, unsigned int *blocks, int y, int *heights)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i vy = _mm_set1_epi32(y);
+    __m128i solid = zero;
+    int i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m128i bv = _mm_setr_epi32(table[classes[i]], table[classes[i + 1]], table[classes[i + 2]], table[classes[i + 3]]);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(blocks + i), bv);
+        __m128i air = _mm_cmpeq_epi32(bv, zero);
+        __m128i h = _mm_loadu_si128(reinterpret_cast<const __m128i*>(heights + i));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(heights + i), _mm_blendv_epi8(vy, h, air));
+        solid = _mm_or_si128(solid, bv);
+    }
+    bool any = !_mm_testz_si128(solid, solid);
+    return mapBlockRowScalar(classes + i, n - i, table, blocks + i, y, heights + i) || any;
+}
+
+TARGET_AVX2 static bool mapBlockRowAvx2(const uint8_t *classes, int n, const unsigned int *table, unsigned int *blocks, int y, int *heights)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i vy = _mm256_set1_epi32(y);
+    __m256i solid = zero;
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256i index = _mm256_cvtepu8_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(classes + i)));
+        __m256i bv = _mm256_i32gather_epi32(reinterpret_cast<const int*>(table), index, 4);
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(blocks + i), bv);
+        __m256i air = _mm256_cmpeq_epi32(bv, zero);
+        __m256i h = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(heights + i));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(heights + i), _mm256_blendv_epi8(vy, h, air));
+        solid = _mm256_or_si256(solid, bv);
+    }
+    bool any = !_mm256_testz_si256(solid, solid);
+    return mapBlockRowScalar(classes + i, n - i, table, blocks + i, y, heights + i) || any;
+}
+
+static void cpuid(int info[4], int function, int subfunction = 0)
+{
+#ifdef _MSC_VER
+    __cpuidex(info, function, subfunction);
+#else
+    __cpuid_count(function, subfunction, info[0], info[1], info[2], info[3]);
+#endif
+}
+
+static uint64_t xgetbv(unsigned int index)
+{
+#ifdef _MSC_VER
+    return _xgetbv(index);
+#else
+    // Inline asm so the caller does not need to be built with -mxsave
+    uint32_t eax, edx;
+    __asm__ volatile("xgetbv" : "=a"(eax), "=d"(edx) : "c"(index));
+    return ((uint64_t)edx << 32) | eax;
+#endif
+}
+
+static bool cpuHasSse41()
+{
+    int info[4];
+    cpuid(info, 1);
+    return (info[2] & (1 << 19)) != 0;
+}
+
+static bool cpuHasAvx2()
+{
+    int info[4];
+    cpuid(info, 0);
+    if (info[0] < 7) return false;
+
+    // The OS also has to save the AVX registers
+    cpuid(info, 1);
+    bool osxsave = (info[2] & (1 << 27)) != 0;
+    bool avx = (info[2] & (1 << 28)) != 0;
+    if (!osxsave || !avx) return false;
+    if ((xgetbv(0) & 6) != 6) return false;
+
+    cpuid(info, 7);
+    return (info[1] & (1 << 5)) != 0;
+}
+
+static BlockRowKernel mapBlockRow = mapBlockRowScalar;
+
+// Picks the fastest block row kernel the CPU supports and returns its name
+static const char* selectBlockRowKernel()
+{
+    if (cpuHasAvx2()) {
+        mapBlockRow = mapBlockRowAvx2;
+        return "AVX2";
+    }
+    if (cpuHasSse41()) {
+        mapBlockRow = mapBlockRowSse41;
+        return "SSE4.1";
+    }
+    mapBlockRow = mapBlockRowScalar;
+    return "scalar";
+}
+
 #define EXPORT_BOX_DEBUG 0
 #define EXPORT_BOX_BINARY 0
 #define EXPORT_BOX_JSON 1
@@ -1965,6 +4125,7 @@ struct BoxResult {
     size_t compressedSize;
 
     bool transformed;
+    uint32_t worldHash;
 
     /*
     // TODO: Put stuff below into a supplementary class and observe mem usage
@@ -2041,6 +4202,16 @@ public:
         return data;
     }
 
+    void* getCompressedBuffer(size_t size) {
+        resizeArray(&compressed, &compressedSize, size);
+        return compressed;
+    }
+
+    // Memory currently held by the box data
+    size_t getBytes() const {
+        return (data ? dataSize : 0) + (compressed ? compressedSize : 0);
+    }
+
     void compress() {
         vassert(data, "Unable to compress null data");
 
@@ -2299,11 +4470,611 @@ public:
 #endif
     }
 
-};
+};
+
+
+/**
+ * All the request parameters a box depends on.
+ */
+struct BoxKey
+{
+    BoxType type;
+    uint32_t worldHash;
+    Vec origin;
+    long x, y, z;
+    long sx, sy, sz;
+    bool transformed;
+
+    bool operator==(const BoxKey &key) const
+    {
+        return
+            type == key.type &&
+            worldHash == key.worldHash &&
+            origin == key.origin &&
+            x == key.x && y == key.y && z == key.z &&
+            sx == key.sx && sy == key.sy && sz == key.sz &&
+            transformed == key.transformed;
+    }
+};
+
+struct BoxKeyHash
+{
+    size_t operator()(const BoxKey &key) const
+    {
+        size_t hash = 0;
+        auto combine = [&hash](size_t value) {
+            hash ^= value + 0x9e3779b9 + (hash << 6) + (hash >> 2);
+        };
+        combine(std::hash<int>()(key.type));
+        combine(std::hash<uint32_t>()(key.worldHash));
+        combine(std::hash<double>()(key.origin.x()));
+        combine(std::hash<double>()(key.origin.y()));
+        combine(std::hash<double>()(key.origin.z()));
+        combine(std::hash<long>()(key.x));
+        combine(std::hash<long>()(key.y));
+        combine(std::hash<long>()(key.z));
+        combine(std::hash<long>()(key.sx));
+        combine(std::hash<long>()(key.sy));
+        combine(std::hash<long>()(key.sz));
+        combine(std::hash<bool>()(key.transformed));
+        return hash;
+    }
+};
+
+/**
+ * Byte limited LRU cache of generated boxes keyed on all of the request
+ * parameters. It is split into shards with their own lock and an equal
+ * part of the limit, so concurrent requests rarely wait on each other.
+ * Boxes are shared, so evicting a box that is still being generated or
+ * sent only drops it from the cache.
+ */
+class BoxCache
+{
+public:
+    typedef std::shared_ptr<BoxResult> BoxRef;
+
+private:
+    struct Entry
+    {
+        BoxKey key;
+        BoxRef box;
+        size_t bytes;
+    };
+
+    struct Shard
+    {
+        std::mutex mutex;
+        std::list<Entry> entries;
+        std::unordered_map<BoxKey, std::list<Entry>::iterator, BoxKeyHash> index;
+        size_t bytes;
+
+        Shard() : bytes(0) {}
+    };
+
+    static const int shardNum = 16;
+    Shard shards[shardNum];
+    size_t shardLimit;
+
+    Shard& getShard(const BoxKey &key)
+    {
+        size_t hash = BoxKeyHash()(key);
+        return shards[(hash ^ (hash >> 16)) % shardNum];
+    }
+
+    // Evicts the least recently used boxes, always keeping the latest one
+    void evict(Shard &shard)
+    {
+        while (shard.bytes > shardLimit && shard.entries.size() > 1) {
+            Entry &entry = shard.entries.back();
+            shard.bytes -= entry.bytes;
+            shard.index.erase(entry.key);
+            shard.entries.pop_back();
+            ++boxCacheEvictions;
+            --boxesCached;
+        }
+    }
+
+public:
+    BoxCache() : shardLimit(0) {}
+
+    // Only set on startup
+    void setLimit(size_t limitBytes)
+    {
+        shardLimit = limitBytes / shardNum;
+        for (Shard &shard : shards) {
+            std::lock_guard<std::mutex> lock(shard.mutex);
+            evict(shard);
+        }
+    }
+
+    /**
+     * Returns the cached box of the key, or a new invalid box added to the
+     * cache for the caller to generate.
+     */
+    BoxRef get(const BoxKey &key)
+    {
+        Shard &shard = getShard(key);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        auto it = shard.index.find(key);
+        if (it != shard.index.end()) {
+            ++boxCacheHits;
+            shard.entries.splice(shard.entries.begin(), shard.entries, it->second);
+            return it->second->box;
+        }
+        ++boxCacheMisses;
+        ++boxesCached;
+        shard.entries.push_front(Entry{ key, std::make_shared<BoxResult>(), 0 });
+        shard.index[key] = shard.entries.begin();
+        return shard.entries.front().box;
+    }
+
+    /**
+     * Accounts for the new size of a generated box, evicting other boxes
+     * if the shard gets over its limit.
+     */
+    void update(const BoxKey &key, const BoxRef &box)
+    {
+        Shard &shard = getShard(key);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        auto it = shard.index.find(key);
+        if (it == shard.index.end() || it->second->box != box) return;
+        Entry &entry = *it->second;
+        size_t bytes = box->getBytes();
+        shard.bytes = shard.bytes - entry.bytes + bytes;
+        entry.bytes = bytes;
+        shard.entries.splice(shard.entries.begin(), shard.entries, it->second);
+        evict(shard);
+    }
+
+    template <typename Func>
+    void forEach(Func fn)
+    {
+        for (Shard &shard : shards) {
+            std::lock_guard<std::mutex> lock(shard.mutex);
+            for (const Entry &entry : shard.entries) fn(entry.key, *entry.box);
+        }
+    }
+};
+
+static BoxCache boxCache;
+
+// Bump when the generated boxes change, so boxes stored on disk by an
+// older version get ignored
+static const uint32_t boxDataVersion = 1;
+
+/**
+ * Disk tier of the box cache that survives restarts. Boxes are appended
+ * to a data file as the blobs they are cached as, mostly LZ4 compressed,
+ * and their keys and locations are appended to an index file read in
+ * one go on startup. Index entries are only written once their data is,
+ * so a crash can at worst leave unreachable data behind. Every entry keeps
+ * the stamp of the section files its box was generated from, see
+ * getBoxSourceStamp, and is ignored once they change. The data of replaced
+ * and ignored boxes is reclaimed by rewriting the live boxes into new files
+ * once it outweighs them.
+ */
+class BoxDisk
+{
+    static const uint32_t version = 2;
+
+    struct Header
+    {
+        char magic[4];
+        uint32_t version;
+    };
+
+    struct IndexEntry
+    {
+        uint32_t dataVersion;
+        uint32_t type;
+        uint32_t worldHash;
+        uint32_t transformed;
+        double origin[3];
+        int64_t x, y, z;
+        int64_t sx, sy, sz;
+        uint32_t compression;
+        uint32_t padding;
+        uint64_t offset;
+        uint64_t dataSize;
+        uint64_t blobSize;
+        uint64_t sourceStamp;
+    };
+
+    std::mutex mutex;
+    std::string dataPath;
+    std::string indexPath;
+    FILE *dataFile;
+    FILE *indexFile;
+    uint64_t dataEnd;
+    uint64_t indexEnd;
+    uint64_t limit;
+    // Blob bytes of the boxes in the index, the rest of the data is dead
+    uint64_t liveBytes;
+    // Set once a write is refused for the limit, until space is reclaimed
+    bool full;
+    std::unordered_map<BoxKey, IndexEntry, BoxKeyHash> index;
+
+    static int seek(FILE *file, uint64_t offset)
+    {
+#ifdef _WIN32
+        return _fseeki64(file, static_cast<long long>(offset), SEEK_SET);
+#else
+        return fseeko(file, static_cast<off_t>(offset), SEEK_SET);
+#endif
+    }
+
+    static uint64_t getEnd(FILE *file)
+    {
+#ifdef _WIN32
+        _fseeki64(file, 0, SEEK_END);
+        return static_cast<uint64_t>(_ftelli64(file));
+#else
+        fseeko(file, 0, SEEK_END);
+        return static_cast<uint64_t>(ftello(file));
+#endif
+    }
+
+    // Opens an existing file with a valid header or starts a new one
+    static FILE* openFile(const std::string &path, const char *magic)
+    {
+        Header h;
+        FILE *file = fopen(path.c_str(), "r+b");
+        if (file) {
+            bool valid =
+                fread(&h, sizeof(h), 1, file) == 1 &&
+                memcmp(h.magic, magic, sizeof(h.magic)) == 0 &&
+                h.version == version;
+            if (valid) return file;
+            fclose(file);
+            plog("Invalid box disk file %s, starting over", path.c_str());
+        }
+
+        file = fopen(path.c_str(), "w+b");
+        if (!file) return nullptr;
+        memcpy(h.magic, magic, sizeof(h.magic));
+        h.version = version;
+        if (fwrite(&h, sizeof(h), 1, file) != 1 || fflush(file) != 0) {
+            fclose(file);
+            return nullptr;
+        }
+        return file;
+    }
+
+    inline uint64_t getDeadBytes() const
+    {
+        return dataEnd - sizeof(Header) - liveBytes;
+    }
+
+    void drop(std::unordered_map<BoxKey, IndexEntry, BoxKeyHash>::iterator it)
+    {
+        liveBytes -= it->second.blobSize;
+        index.erase(it);
+    }
+
+    /**
+     * Rewrites the live boxes into new data and index files, dropping the
+     * data of replaced and stale boxes and the oldest boxes over the limit.
+     * Closes the disk if the files can't be replaced.
+     */
+    bool compact()
+    {
+        dtimer("box disk compact");
+
+        plog("Compacting box disk %s, %llu MB live of %llu MB", dataPath.c_str(),
+            (unsigned long long)(liveBytes / 1024 / 1024), (unsigned long long)(dataEnd / 1024 / 1024));
+
+        std::vector<IndexEntry> entries;
+        entries.reserve(index.size());
+        for (auto &iter : index) entries.push_back(iter.second);
+        std::sort(entries.begin(), entries.end(), [](const IndexEntry &a, const IndexEntry &b) {
+            return a.offset < b.offset;
+        });
+
+        // Leftovers of an interrupted compaction would be reused otherwise
+        std::string dataTempPath = dataPath + ".temp";
+        std::string indexTempPath = indexPath + ".temp";
+        remove(dataTempPath.c_str());
+        remove(indexTempPath.c_str());
+        FILE *dataTemp = openFile(dataTempPath, "VXBD");
+        FILE *indexTemp = dataTemp ? openFile(indexTempPath, "VXBI") : nullptr;
+
+        // Newest boxes that fit in the limit
+        size_t first = entries.size();
+        uint64_t keptBytes = sizeof(Header);
+        while (first > 0 && keptBytes + entries[first - 1].blobSize <= limit) {
+            first--;
+            keptBytes += entries[first].blobSize;
+        }
+
+        bool ok = dataTemp && indexTemp;
+        uint64_t end = sizeof(Header);
+        std::vector<char> blob;
+        std::vector<IndexEntry> kept;
+        kept.reserve(entries.size() - first);
+        for (size_t i = first; ok && i < entries.size(); i++) {
+            IndexEntry entry = entries[i];
+            size_t blobSize = static_cast<size_t>(entry.blobSize);
+            blob.resize(blobSize);
+            ok =
+                seek(dataFile, entry.offset) == 0 &&
+                fread(blob.data(), 1, blobSize, dataFile) == blobSize &&
+                fwrite(blob.data(), 1, blobSize, dataTemp) == blobSize;
+            entry.offset = end;
+            ok = ok && fwrite(&entry, sizeof(entry), 1, indexTemp) == 1;
+            end += entry.blobSize;
+            kept.push_back(entry);
+        }
+        if (dataTemp && fclose(dataTemp) != 0) ok = false;
+        if (indexTemp && fclose(indexTemp) != 0) ok = false;
+
+        if (!ok) {
+            plog("Unable to compact box disk %s", dataPath.c_str());
+            remove(dataTempPath.c_str());
+            remove(indexTempPath.c_str());
+            return false;
+        }
+
+        fclose(dataFile);
+        fclose(indexFile);
+        dataFile = nullptr;
+        indexFile = nullptr;
+        remove(dataPath.c_str());
+        remove(indexPath.c_str());
+        ok =
+            rename(dataTempPath.c_str(), dataPath.c_str()) == 0 &&
+            rename(indexTempPath.c_str(), indexPath.c_str()) == 0;
+        if (ok) {
+            dataFile = openFile(dataPath, "VXBD");
+            indexFile = dataFile ? openFile(indexPath, "VXBI") : nullptr;
+            ok = dataFile && indexFile;
+        }
+        if (!ok) {
+            plog("Unable to replace box disk files %s", dataPath.c_str());
+            close();
+            return false;
+        }
+
+        boxDiskBytes -= dataEnd;
+        dataEnd = end;
+        boxDiskBytes += dataEnd;
+        indexEnd = sizeof(Header) + kept.size()*sizeof(IndexEntry);
+        liveBytes = end - sizeof(Header);
+        full = false;
+        index.clear();
+        for (const IndexEntry &entry : kept) index[getKey(entry)] = entry;
+
+        return true;
+    }
+
+    static BoxKey getKey(const IndexEntry &entry)
+    {
+        BoxKey key;
+        key.type = static_cast<BoxType>(entry.type);
+        key.worldHash = entry.worldHash;
+        key.origin << entry.origin[0], entry.origin[1], entry.origin[2];
+        key.x = static_cast<long>(entry.x);
+        key.y = static_cast<long>(entry.y);
+        key.z = static_cast<long>(entry.z);
+        key.sx = static_cast<long>(entry.sx);
+        key.sy = static_cast<long>(entry.sy);
+        key.sz = static_cast<long>(entry.sz);
+        key.transformed = entry.transformed != 0;
+        return key;
+    }
+
+public:
+    BoxDisk() : dataFile(nullptr), indexFile(nullptr), dataEnd(0), indexEnd(0), limit(0), liveBytes(0), full(false) {}
+
+    ~BoxDisk()
+    {
+        close();
+    }
+
+    bool isOpen() const
+    {
+        return dataFile != nullptr;
+    }
+
+    /**
+     * Opens or creates the data file at `path` and its index next to it,
+     * storing new boxes until the data reaches `limitBytes`.
+     */
+    bool open(const std::string &path, uint64_t limitBytes)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        dtimer("box disk open");
+
+        if (!mkdirp(path.c_str())) {
+            plog("Unable to create directory for %s", path.c_str());
+            return false;
+        }
+
+        dataPath = path;
+        indexPath = path + ".idx";
+        dataFile = openFile(dataPath, "VXBD");
+        indexFile = dataFile ? openFile(indexPath, "VXBI") : nullptr;
+        if (!dataFile || !indexFile) {
+            plog("Unable to open box disk files %s", path.c_str());
+            close();
+            return false;
+        }
+
+        limit = limitBytes;
+        dataEnd = getEnd(dataFile);
+
+        size_t entryNum = static_cast<size_t>((getEnd(indexFile) - sizeof(Header)) / sizeof(IndexEntry));
+        std::vector<IndexEntry> entries(entryNum);
+        seek(indexFile, sizeof(Header));
+        entryNum = entryNum > 0 ? fread(entries.data(), sizeof(IndexEntry), entryNum, indexFile) : 0;
+
+        // New entries overwrite a partially written last one
+        indexEnd = sizeof(Header) + entryNum*sizeof(IndexEntry);
+
+        // Later entries replace earlier ones of the same box
+        int stale = 0;
+        for (size_t i = 0; i < entryNum; i++) {
+            const IndexEntry &entry = entries[i];
+            if (entry.dataVersion != boxDataVersion || entry.offset + entry.blobSize > dataEnd) {
+                stale++;
+                continue;
+            }
+            index[getKey(entry)] = entry;
+        }
+
+        liveBytes = 0;
+        for (auto &iter : index) liveBytes += iter.second.blobSize;
+
+        boxDiskBytes += dataEnd;
+
+        plog("Box disk %s: %zd boxes, %d stale, %llu MB", path.c_str(), index.size(), stale, (unsigned long long)(dataEnd / 1024 / 1024));
+
+        if (dataEnd > limit || getDeadBytes() > liveBytes) compact();
+
+        return isOpen();
+    }
+
+    void close()
+    {
+        if (dataFile) fclose(dataFile);
+        if (indexFile) fclose(indexFile);
+        dataFile = nullptr;
+        indexFile = nullptr;
+        boxDiskBytes -= dataEnd;
+        dataEnd = 0;
+        indexEnd = 0;
+        liveBytes = 0;
+        full = false;
+        index.clear();
+    }
+
+    /**
+     * Reads the stored box of the key into `br`, returns false if the box
+     * isn't stored or was generated from other section files.
+     */
+    bool read(const BoxKey &key, uint64_t sourceStamp, BoxResult &br)
+    {
+        if (!isOpen()) return false;
+
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = index.find(key);
+        if (it != index.end() && it->second.sourceStamp != sourceStamp) {
+            drop(it);
+            it = index.end();
+        }
+        if (it == index.end()) {
+            ++boxDiskMisses;
+            return false;
+        }
+        const IndexEntry &entry = it->second;
+
+        dtimer("box disk read");
+
+        br.removeData();
+        br.removeCompressed();
+
+        size_t blobSize = static_cast<size_t>(entry.blobSize);
+        bool lz4 = entry.compression == BoxCompression::LZ4;
+        void *blob = lz4 ? br.getCompressedBuffer(blobSize) : br.getBuffer(blobSize);
+        if (seek(dataFile, entry.offset) != 0 || fread(blob, 1, blobSize, dataFile) != blobSize) {
+            plog("Unable to read stored box at %llu", (unsigned long long)entry.offset);
+            br.removeData();
+            br.removeCompressed();
+            drop(it);
+            return false;
+        }
+
+        br.type = key.type;
+        br.worldHash = key.worldHash;
+        br.origin = key.origin;
+        br.x = key.x;
+        br.y = key.y;
+        br.z = key.z;
+        br.sx = key.sx;
+        br.sy = key.sy;
+        br.sz = key.sz;
+        br.transformed = key.transformed;
+        br.compression = lz4 ? BoxCompression::LZ4 : BoxCompression::None;
+        br.dataSize = static_cast<size_t>(entry.dataSize);
+
+        ++boxDiskHits;
+
+        return true;
+    }
+
+    /**
+     * Appends a box generated from the section files of `sourceStamp`,
+     * unless the data file is over the limit.
+     */
+    void write(const BoxKey &key, uint64_t sourceStamp, const BoxResult &br)
+    {
+        if (!isOpen()) return;
+
+        const void *blob = br.compressed ? br.compressed : br.data;
+        if (!blob) return;
+
+        IndexEntry entry = {};
+        entry.dataVersion = boxDataVersion;
+        entry.type = key.type;
+        entry.worldHash = key.worldHash;
+        entry.transformed = key.transformed ? 1 : 0;
+        entry.origin[0] = key.origin.x();
+        entry.origin[1] = key.origin.y();
+        entry.origin[2] = key.origin.z();
+        entry.x = key.x;
+        entry.y = key.y;
+        entry.z = key.z;
+        entry.sx = key.sx;
+        entry.sy = key.sy;
+        entry.sz = key.sz;
+        entry.compression = br.compressed ? BoxCompression::LZ4 : BoxCompression::None;
+        entry.dataSize = br.dataSize;
+        entry.blobSize = br.compressed ? br.compressedSize : br.dataSize;
+        entry.sourceStamp = sourceStamp;
+
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!isOpen()) return;
+        if (dataEnd + entry.blobSize > limit && getDeadBytes() > liveBytes) {
+            if (!compact()) return;
+        }
+        if (dataEnd + entry.blobSize > limit) {
+            if (!full) plog("Box disk %s reached its limit of %llu MB, new boxes are not stored", dataPath.c_str(), (unsigned long long)(limit / 1024 / 1024));
+            full = true;
+            return;
+        }
+
+        dtimer("box disk write");
+
+        entry.offset = dataEnd;
+        bool ok =
+            seek(dataFile, dataEnd) == 0 &&
+            fwrite(blob, 1, static_cast<size_t>(entry.blobSize), dataFile) == entry.blobSize &&
+            fflush(dataFile) == 0;
+        if (!ok) {
+            plog("Unable to store box at %llu", (unsigned long long)dataEnd);
+            return;
+        }
+        dataEnd += entry.blobSize;
+        boxDiskBytes += entry.blobSize;
+
+        ok =
+            seek(indexFile, indexEnd) == 0 &&
+            fwrite(&entry, sizeof(entry), 1, indexFile) == 1 &&
+            fflush(indexFile) == 0;
+        if (!ok) {
+            plog("Unable to index stored box at %llu", (unsigned long long)entry.offset);
+            return;
+        }
+        indexEnd += sizeof(entry);
 
+        auto it = index.find(key);
+        if (it != index.end()) drop(it);
+        index[key] = entry;
+        liveBytes += entry.blobSize;
+        ++boxDiskWrites;
+    }
+};
 
-static SpatialHash<BoxResult> boxHash;
-static BoxResult invalidBoxResult;
+static BoxDisk boxDisk;
 
 
 static const int blockImage[9] = {
@@ -2564,50 +5335,296 @@ public:
         return it->second;
     }
 
+    // Section name to block mapping of all the sections in the database
+    const std::map<std::string, std::string>& getSections() const {
+        return nameToBlock;
+    }
+
 };
 
 Fishnet fishnet;
 
 
+static void indexSections()
+{
+    plog("Indexing LIDAR sections");
+    plogScope();
+
+    int indexed = 0;
+    int skipped = 0;
+    int missing = 0;
 
+    for (auto &section : fishnet.getSections()) {
+        std::string lidarPath = fmt::format(gkotFullFormat, section.second, section.first);
+        normalizeSlashes(const_cast<char*>(lidarPath.c_str()));
 
+        long long lidarTime = getFileModifiedTime(lidarPath.c_str());
+        if (lidarTime == -1) {
+            missing++;
+            continue;
+        }
 
-static void renderBoxesUsed(MapImage &img)
+        if (getFileModifiedTime(getLasIndexPath(lidarPath).c_str()) >= lidarTime) {
+            skipped++;
+            continue;
+        }
+
+        plog("Indexing %s", lidarPath.c_str());
+        if (buildLasIndex(lidarPath.c_str())) indexed++;
+    }
+
+    plog("Indexed %d sections, %d up to date, %d missing", indexed, skipped, missing);
+}
+
+/**
+ * Accumulates per-section statistics of the loaded points.
+ */
+class StatsSink : public PointSink
+{
+public:
+    Count points;
+    Count classes[256];
+    Point min;
+    Point max;
+
+    StatsSink() : points(0)
+    {
+        memset(classes, 0, sizeof(classes));
+        min.x = min.y = min.z = INFINITY;
+        max.x = max.y = max.z = -INFINITY;
+    }
+
+    void addPoint(const Point &p) override
+    {
+        points++;
+        classes[p.classification]++;
+        if (p.x < min.x) min.x = p.x;
+        if (p.y < min.y) min.y = p.y;
+        if (p.z < min.z) min.z = p.z;
+        if (p.x > max.x) max.x = p.x;
+        if (p.y > max.y) max.y = p.y;
+        if (p.z > max.z) max.z = p.z;
+    }
+};
+
+/**
+ * Writes the statistics JSON of a section from its point store, BDMR and
+ * map image.
+ */
+static bool writeSectionStats(const std::string &name, const std::string &block, const std::string &storePath, const std::string &bdmrPath, const std::string &mapPath, const std::string &statsPath)
+{
+    StatsSink stats;
+    {
+        PointStore store;
+        if (!store.open(storePath.c_str())) {
+            plog("Unable to open point store %s", storePath.c_str());
+            return false;
+        }
+        store.load(stats);
+        store.close();
+    }
+
+    auto classes = ujson::object();
+    for (int i = 0; i < 256; i++) {
+        if (stats.classes[i] == 0) continue;
+        classes.push_back(std::make_pair(std::to_string(i), ujson::value(static_cast<double>(stats.classes[i]))));
+    }
+
+    auto result = ujson::object {
+        { "name", name },
+        { "block", block },
+        { "points", static_cast<double>(stats.points) },
+        { "ground", static_cast<double>(stats.classes[Classification::GROUND]) },
+        { "classes", classes }
+    };
+
+    if (stats.points > 0) {
+        result.push_back(std::make_pair("min", ujson::array { stats.min.x, stats.min.y, stats.min.z }));
+        result.push_back(std::make_pair("max", ujson::array { stats.max.x, stats.max.y, stats.max.z }));
+    }
+
+    {
+        size_t length;
+        char* mapped = map_file(bdmrPath.c_str(), &length);
+        if (mapped) {
+            if (length == bdmrWidth * bdmrHeight * sizeof(int32_t)) {
+                const int32_t *heights = reinterpret_cast<const int32_t*>(mapped);
+                int32_t hmin = heights[0];
+                int32_t hmax = heights[0];
+                for (int i = 1; i < bdmrWidth * bdmrHeight; i++) {
+                    if (heights[i] < hmin) hmin = heights[i];
+                    if (heights[i] > hmax) hmax = heights[i];
+                }
+                result.push_back(std::make_pair("heightMin", ujson::value(hmin / 100.0)));
+                result.push_back(std::make_pair("heightMax", ujson::value(hmax / 100.0)));
+            }
+            unmap_file(mapped, length);
+        }
+    }
+
+    {
+        int width, height, comp;
+        if (stbi_info(mapPath.c_str(), &width, &height, &comp)) {
+            result.push_back(std::make_pair("mapWidth", ujson::value(width)));
+            result.push_back(std::make_pair("mapHeight", ujson::value(height)));
+        }
+    }
+
+    std::string tempPath = statsPath + ".temp";
+    FILE *file = fopen(tempPath.c_str(), "wb");
+    if (!file) {
+        plog("Unable to write %s", tempPath.c_str());
+        return false;
+    }
+
+    std::string str = ujson::to_string(result);
+    bool ok = fwrite(str.data(), 1, str.size(), file) == str.size();
+    if (fclose(file) != 0) ok = false;
+
+    if (ok) {
+        remove(statsPath.c_str());
+        ok = rename(tempPath.c_str(), statsPath.c_str()) == 0;
+    }
+
+    if (!ok) {
+        plog("Unable to save section stats %s", statsPath.c_str());
+        remove(tempPath.c_str());
+    }
+
+    return ok;
+}
+
+/**
+ * Builds the LAS index, point store, neighbour tree and statistics of every
+ * fishnet section in parallel. Outputs are written to temporary files and renamed, and the
+ * ones newer than their inputs are skipped, so an interrupted bake can just
+ * be run again.
+ */
+static void bakeSections()
 {
-    int hashEdge = static_cast<int>(round(sqrt(boxHash.size)));
+    plog("Baking sections");
+    plogScope();
+
+    dtimer("bake");
+
+    std::vector<std::pair<std::string, std::string>> sections(fishnet.getSections().begin(), fishnet.getSections().end());
+
+    std::atomic<int> baked(0);
+    std::atomic<int> skipped(0);
+    std::atomic<int> missing(0);
+    std::atomic<int> failed(0);
+
+    workers.run(static_cast<int>(sections.size()), [&](int i) {
+        const std::string &name = sections[i].first;
+        const std::string &block = sections[i].second;
+
+        std::string lidarPath = fmt::format(gkotFullFormat, block, name);
+        std::string mapPath = fmt::format(dof84FullFormat, block, name);
+        std::string bdmrPath = fmt::format(bdmrFullFormat, block, name);
+        std::string storePath = fmt::format(storeFullFormat, block, name);
+        std::string statsPath = fmt::format(statsFullFormat, block, name);
+        std::string treePath = fmt::format(treeFullFormat, block, name);
+        normalizeSlashes(const_cast<char*>(treePath.c_str()));
+        normalizeSlashes(const_cast<char*>(lidarPath.c_str()));
+        normalizeSlashes(const_cast<char*>(mapPath.c_str()));
+        normalizeSlashes(const_cast<char*>(bdmrPath.c_str()));
+        normalizeSlashes(const_cast<char*>(storePath.c_str()));
+        normalizeSlashes(const_cast<char*>(statsPath.c_str()));
+
+        long long lidarTime = getFileModifiedTime(lidarPath.c_str());
+        if (lidarTime == -1) {
+            missing++;
+            return;
+        }
+
+        bool ok = true;
+        bool changed = false;
+
+        if (getFileModifiedTime(getLasIndexPath(lidarPath).c_str()) < lidarTime) {
+            ok = buildLasIndex(lidarPath.c_str()) && ok;
+            changed = true;
+        }
+
+        if (PointStore::isStale(lidarPath.c_str(), storePath.c_str())) {
+            ok = PointStore::build(lidarPath.c_str(), storePath.c_str()) && ok;
+            changed = true;
+        }
+
+        if (ok && useTrees) {
+            PointStore store;
+            ok = store.open(storePath.c_str());
+            if (ok) {
+                SectionSearch search(store, treePath.c_str(), treeMaxLeaf);
+                if (SectionSearch::isStale(storePath.c_str(), treePath.c_str()) || !search.hasTree()) {
+                    ok = search.buildTree();
+                    changed = true;
+                }
+            }
+        }
+
+        long long inputTime = std::max(
+            getFileModifiedTime(storePath.c_str()),
+            std::max(getFileModifiedTime(bdmrPath.c_str()), getFileModifiedTime(mapPath.c_str()))
+        );
+        if (ok && getFileModifiedTime(statsPath.c_str()) < inputTime) {
+            ok = writeSectionStats(name, block, storePath, bdmrPath, mapPath, statsPath);
+            changed = true;
+        }
+
+        if (!ok) {
+            plog("Unable to bake %s", name.c_str());
+            failed++;
+        } else if (changed) {
+            ++sectionsBaked;
+            baked++;
+        } else {
+            skipped++;
+        }
+    });
+
+    plog("Baked %d sections, %d up to date, %d missing, %d failed", baked.load(), skipped.load(), missing.load(), failed.load());
+}
+
+
+
+
 
-    int width = hashEdge;
-    int height = width;
+static void renderBoxesUsed(MapImage &img)
+{
+    const int width = 256;
+    const int height = width;
 
     int tileSize = 1;
 
     int pixelWidth = width*tileSize;
     int pixelHeight = height*tileSize;
 
-    int offX = -width / 2;
-    int offY = -height / 2;
-
     size_t pixelsLen = pixelWidth*pixelHeight;
     std::unique_ptr<unsigned int> pixels((new unsigned int[pixelsLen]()));
 
-    for (int iy = 0; iy < height; iy++) {
-        for (int ix = 0; ix < width; ix++) {
-            //if (ix + iy*width >= len) break;
+    // Boxes by footprint wrapped around the image, brighter if used recently
+    long now = boxHashAccess;
+    boxCache.forEach([&](const BoxKey &key, const BoxResult &br) {
+        int ix = static_cast<int>(((key.x / key.sx) % width + width) % width);
+        int iy = static_cast<int>(((key.z / key.sz) % height + height) % height);
 
-            BoxResult &br = boxHash.at(ix + offX, iy + offY);
+        char r = 0;
+        char g = 0;
+        char b = 0;
 
-            char r = 0;
-            char g = 0;
-            char b = 0;
+        r = g = b = std::max(0, 0xFF - (int)(now - br.access));
 
-            r = g = b = std::max(0, 0xFF - (int)(boxHashAccess - br.access));
+        // Keep the most recent of the boxes stacked on the same pixel
+        unsigned int previous = pixels.get()[ix*tileSize + iy*tileSize*pixelWidth];
+        if ((previous & 0xFF) >= (unsigned int)(b & 0xFF)) return;
 
-            unsigned int color = ((r & 0xFF) << 16) | ((g & 0xFF) << 8) | (b & 0xFF);
+        unsigned int color = ((r & 0xFF) << 16) | ((g & 0xFF) << 8) | (b & 0xFF);
 
-            color |= 0xFF000000;
-            paintRect(pixels.get(), pixelWidth, ix*tileSize, iy*tileSize, color, tileSize, tileSize);
-        }
-    }
+        color |= 0xFF000000;
+        paintRect(pixels.get(), pixelWidth, ix*tileSize, iy*tileSize, color, tileSize, tileSize);
+    });
+
+    for (size_t i = 0; i < pixelsLen; i++) pixels.get()[i] |= 0xFF000000;
 
     encodeImage(&img, pixels.get(), pixelWidth, pixelHeight);
 }
@@ -2703,6 +5720,31 @@ static void renderMapClouds(MapImage &img)
 }
 
 
+/**
+ * Paths of the files of the section at lat, lon. Returns false if the
+ * section isn't in the fishnet.
+ */
+static bool getSectionPaths(int lat, int lon, std::string &lidarPath, std::string &mapPath, std::string &bdmrPath, std::string &storePath, std::string &treePath)
+{
+    std::string name = fmt::format(nameFormat, lat, lon);
+    std::string block = fishnet.getBlockFromName(name);
+    if (block == fishnet.blockNotAvailable) return false;
+
+    lidarPath = fmt::format(gkotFullFormat, block, name);
+    mapPath = fmt::format(dof84FullFormat, block, name);
+    bdmrPath = fmt::format(bdmrFullFormat, block, name);
+    storePath = fmt::format(storeFullFormat, block, name);
+    treePath = fmt::format(treeFullFormat, block, name);
+
+    normalizeSlashes(const_cast<char*>(lidarPath.c_str()));
+    normalizeSlashes(const_cast<char*>(mapPath.c_str()));
+    normalizeSlashes(const_cast<char*>(bdmrPath.c_str()));
+    normalizeSlashes(const_cast<char*>(storePath.c_str()));
+    normalizeSlashes(const_cast<char*>(treePath.c_str()));
+
+    return true;
+}
+
 MapCloudRef acquireMapCloud(int lat, int lon)
 {
 
@@ -2716,19 +5758,9 @@ MapCloudRef acquireMapCloud(int lat, int lon)
     }
 
     // Not found, create a new one
-    std::string name = fmt::format(nameFormat, lat, lon);
-    std::string block = fishnet.getBlockFromName(name);
-
-    if (block != fishnet.blockNotAvailable) {
-        std::string gkotPath = fmt::format(gkotFullFormat, block, name);
-        std::string dof84Path = fmt::format(dof84FullFormat, block, name);
-        std::string bdmrPath = fmt::format(bdmrFullFormat, block, name);
-
-        normalizeSlashes(const_cast<char*>(gkotPath.c_str()));
-        normalizeSlashes(const_cast<char*>(dof84Path.c_str()));
-        normalizeSlashes(const_cast<char*>(bdmrPath.c_str()));
-
-        MapCloud *mc = new MapCloud(lat, lon, gkotPath, dof84Path, bdmrPath);
+    std::string gkotPath, dof84Path, bdmrPath, storePath, treePath;
+    if (getSectionPaths(lat, lon, gkotPath, dof84Path, bdmrPath, storePath, treePath)) {
+        MapCloud *mc = new MapCloud(lat, lon, gkotPath, dof84Path, bdmrPath, storePath, treePath);
         mapCloudList.push_front(mc);
         mc->acquire();
         trimMapCloudList();
@@ -2787,43 +5819,43 @@ static void extendColumn(int bx, int by, int bz, int sx, unsigned int* columns,
     if (by > col) columns[colindex] = by;
 }
 
-static void applyBlockToCloud(Vec origin, int bx, int by, int bz, Classification c, PointCloud *cloud) {
+template <typename Cloud>
+static void applyBlockToCloud(Vec origin, int bx, int by, int bz, Classification c, Cloud *cloud) {
     Vec query_block_center;
     getCoordsFromBlock(origin, bx, by, bz, query_block_center);
 
     Vec block_center; block_center << 0.5, 0.5, 0.5;
     query_block_center += block_center;
 
-    const pcln radius = M_SQRT2;
-    std::vector<std::pair<size_t, pcln> > indices;
-    RadiusResultSet<pcln, size_t> points(radius*radius, indices);
+    const pcdist radius = static_cast<pcdist>(M_SQRT2);
+    std::vector<std::pair<size_t, pcdist> > indices;
+    RadiusResultSet<pcdist, size_t> points(radius*radius, indices);
     cloud->findRadius(query_block_center.data(), points);
 
     for (size_t in = 0; in < points.size(); in++) {
-        std::pair<size_t, pcln> pair = points.m_indices_dists[in];
-        Point &p = cloud->getPoint(pair.first);
-        p.classification = c;
+        std::pair<size_t, pcdist> pair = points.m_indices_dists[in];
+        cloud->setClassification(pair.first, c);
     }
 }
 
-static Classification getBlockFromCloud(Vec origin, int bx, int by, int bz, PointCloud *cloud) {
+template <typename Cloud>
+static Classification getBlockFromCloud(Vec origin, int bx, int by, int bz, Cloud *cloud) {
     Vec query_block_center;
     getCoordsFromBlock(origin, bx, by, bz, query_block_center);
 
     Vec block_center; block_center << 0.5, 0.5, 0.5;
     query_block_center += block_center;
 
-    const pcln radius = M_SQRT1_2;
-    std::vector<std::pair<size_t, pcln> > indices;
-    RadiusResultSet<pcln, size_t> points(radius*radius, indices);
+    const pcdist radius = static_cast<pcdist>(M_SQRT1_2);
+    std::vector<std::pair<size_t, pcdist> > indices;
+    RadiusResultSet<pcdist, size_t> points(radius*radius, indices);
     cloud->findRadius(query_block_center.data(), points);
 
     int classificationCounters[Classification::END] = { 0 };
 
     for (size_t in = 0; in < points.size(); in++) {
-        std::pair<size_t, pcln> pair = points.m_indices_dists[in];
-        Point &p = cloud->getPoint(pair.first);
-        classificationCounters[p.classification]++;
+        std::pair<size_t, pcdist> pair = points.m_indices_dists[in];
+        classificationCounters[cloud->getClassification(pair.first)]++;
     }
 
     int maxCount = 0;
@@ -2846,7 +5878,11 @@ static void setCornersFromRefs(const MapCloudRef(&cls)[4], MapCloud* (&corners)[
     corners[3] = cls[3].cloud;
 }
 
-static int getCornerMapClouds(MapCloudRef(&cornerClouds)[4], const Vec min, const Vec max) {
+/**
+ * Finds the distinct sections under the corners of an area and returns
+ * their number, with the corner index, lat and lon of each in latlon.
+ */
+static int getCornerSections(int (&latlon)[4][3], const Vec &min, const Vec &max) {
     const int cornerNum = 4;
     const pcln corners[cornerNum][2] = {
         { min.x(), min.y() },{ max.x(), min.y() },
@@ -2854,7 +5890,6 @@ static int getCornerMapClouds(MapCloudRef(&cornerClouds)[4], const Vec min, cons
     };
 
     int latlonCount = 0;
-    int latlon[cornerNum][3];
 
     for (int i = 0; i < cornerNum; i++) {
 
@@ -2881,6 +5916,13 @@ static int getCornerMapClouds(MapCloudRef(&cornerClouds)[4], const Vec min, cons
         latlonCount++;
     }
 
+    return latlonCount;
+}
+
+static int getCornerMapClouds(MapCloudRef(&cornerClouds)[4], const Vec min, const Vec max) {
+    int latlon[4][3];
+    int latlonCount = getCornerSections(latlon, min, max);
+
     for (int i = 0; i < latlonCount; i++) {
         int index = latlon[i][0];
         int lat = latlon[i][1];
@@ -2891,40 +5933,473 @@ static int getCornerMapClouds(MapCloudRef(&cornerClouds)[4], const Vec min, cons
         //cornerClouds[index] = mc;
     }
 
-    return latlonCount;
-}
+    return latlonCount;
+}
+
+
+static std::mutex boxvisMutex;
+
+static void getBounds(const Vec &origin,
+    const int x, const int y, const int z,
+    const int sx, const int sy, const int sz,
+    Vec &bounds_tl, Vec &bounds_br,
+    Vec &bounds_min, Vec &bounds_max
+) {
+    getCoordsFromBlock(origin, x, y, z, bounds_tl);
+    getCoordsFromBlock(origin, x + sx, y + sy, z + sz, bounds_br);
+    bounds_min = bounds_tl.cwiseMin(bounds_br);
+    bounds_max = bounds_tl.cwiseMax(bounds_br);
+}
+
+/**
+ * Stamp of the current files of the sections under the corners of a box,
+ * equal to getCornerSourceStamp of its corner map clouds if they were
+ * loaded from the same files.
+ */
+static uint64_t getBoxSourceStamp(const Vec &origin,
+    const int x, const int y, const int z,
+    const int sx, const int sy, const int sz
+) {
+    Vec bounds_tl, bounds_br, bounds_min, bounds_max;
+    getBounds(origin, x, y, z, sx, sy, sz, bounds_tl, bounds_br, bounds_min, bounds_max);
+
+    int latlon[4][3];
+    int latlonCount = getCornerSections(latlon, bounds_min, bounds_max);
+
+    uint64_t stamps[4] = {};
+    for (int i = 0; i < latlonCount; i++) {
+        std::string lidarPath, mapPath, bdmrPath, storePath, treePath;
+        if (!getSectionPaths(latlon[i][1], latlon[i][2], lidarPath, mapPath, bdmrPath, storePath, treePath)) continue;
+        stamps[latlon[i][0]] = getSectionStamp(lidarPath, storePath, mapPath, bdmrPath);
+    }
+
+    uint64_t stamp = 0;
+    for (int i = 0; i < 4; i++) combineStamp(stamp, stamps[i]);
+    return stamp;
+}
+
+static uint64_t getCornerSourceStamp(const MapCloudRef (&cornerClouds)[4])
+{
+    uint64_t stamp = 0;
+    for (int i = 0; i < 4; i++) combineStamp(stamp, cornerClouds[i].cloud ? cornerClouds[i].cloud->sourceStamp : 0);
+    return stamp;
+}
+
+
+
+/**
+ * Largest radius of the neighbourhood queries done on the points of a box.
+ */
+static pcln getQueryRadiusMax()
+{
+    pcln radius = M_SQRT2;
+    for (auto &filter : classificationFilters) {
+        if (filter.radius > radius) radius = filter.radius;
+    }
+    return radius;
+}
+
+/**
+ * Returns the load filter of a box, rejecting points out of query reach
+ * above or below the box. Overlap points are kept for the neighbourhood
+ * queries and only skipped by quantization.
+ */
+static PointFilter getBoxFilter(const Vec &bounds_tl, const int sy)
+{
+    PointFilter filter;
+    pcln margin = getQueryRadiusMax() + 1;
+    filter.zMin = bounds_tl.z() - margin;
+    filter.zMax = bounds_tl.z() + sy + margin;
+    return filter;
+}
+
+/**
+ * Blocks [from, to) of a column with the same classification.
+ */
+struct BlockRun
+{
+    uint16_t from;
+    uint16_t to;
+    uint8_t classification;
+};
+
+/**
+ * Classifications of the blocks of a box as sorted runs in every column.
+ * Air is not stored, so memory and the time of column operations depend
+ * on the complexity of the surface instead of the volume of the box.
+ * Different columns can be modified from different threads.
+ */
+class BlockColumns
+{
+    int sx, sy, sz;
+    std::vector<std::vector<BlockRun>> columns;
+
+    // First run of the column ending after y
+    static std::vector<BlockRun>::iterator findRun(std::vector<BlockRun> &runs, int y)
+    {
+        return std::lower_bound(runs.begin(), runs.end(), y, [](const BlockRun &run, int y) {
+            return run.to <= y;
+        });
+    }
+
+public:
+    BlockColumns(int sx, int sy, int sz) : sx(sx), sy(sy), sz(sz), columns(sx*sz) {}
+
+    inline int getSizeY() const
+    {
+        return sy;
+    }
+
+    inline const std::vector<BlockRun>& getRuns(int colindex) const
+    {
+        return columns[colindex];
+    }
+
+    uint8_t get(int colindex, int y) const
+    {
+        const std::vector<BlockRun> &runs = columns[colindex];
+        auto run = std::lower_bound(runs.begin(), runs.end(), y, [](const BlockRun &run, int y) {
+            return run.to <= y;
+        });
+        if (run == runs.end() || run->from > y) return Classification::NONE;
+        return run->classification;
+    }
+
+    inline void set(int colindex, int y, uint8_t classification)
+    {
+        fill(colindex, y, y + 1, classification);
+    }
+
+    /**
+     * Sets the blocks [from, to) of a column, NONE removes them.
+     */
+    void fill(int colindex, int from, int to, uint8_t classification)
+    {
+        from = std::max(from, 0);
+        to = std::min(to, sy);
+        if (from >= to) return;
+
+        std::vector<BlockRun> &runs = columns[colindex];
+        auto first = findRun(runs, from);
+        auto last = first;
+        while (last != runs.end() && last->from < to) ++last;
+
+        // Overlapping runs are replaced by their parts outside the range
+        BlockRun replaced[3];
+        int replacedNum = 0;
+        if (first != last && first->from < from) {
+            replaced[replacedNum++] = { first->from, static_cast<uint16_t>(from), first->classification };
+        }
+        if (classification != Classification::NONE) {
+            replaced[replacedNum++] = { static_cast<uint16_t>(from), static_cast<uint16_t>(to), classification };
+        }
+        if (first != last && (last - 1)->to > to) {
+            replaced[replacedNum++] = { static_cast<uint16_t>(to), (last - 1)->to, (last - 1)->classification };
+        }
+
+        size_t index = first - runs.begin();
+        first = runs.erase(first, last);
+        runs.insert(first, replaced, replaced + replacedNum);
+
+        // Merge touching runs of the same class around the range
+        size_t mergeFrom = index > 0 ? index - 1 : 0;
+        size_t mergeTo = std::min(runs.size(), index + replacedNum + 1);
+        for (size_t i = mergeFrom; i + 1 < mergeTo;) {
+            BlockRun &run = runs[i];
+            const BlockRun &next = runs[i + 1];
+            if (run.to == next.from && run.classification == next.classification) {
+                run.to = next.to;
+                runs.erase(runs.begin() + i + 1);
+                mergeTo--;
+            } else {
+                i++;
+            }
+        }
+    }
+
+    /**
+     * Sets the blocks [from, to) of a column with a classification of at
+     * most maxClassification, including air.
+     */
+    void fillBelowClass(int colindex, int from, int to, uint8_t maxClassification, uint8_t classification)
+    {
+        from = std::max(from, 0);
+        to = std::min(to, sy);
+        if (from >= to) return;
+
+        // Collect the ranges first, filling changes the runs
+        static thread_local std::vector<std::pair<int, int>> ranges;
+        ranges.clear();
+        auto addRange = [&](int rangeFrom, int rangeTo) {
+            if (rangeFrom < rangeTo) ranges.push_back({ rangeFrom, rangeTo });
+        };
+
+        std::vector<BlockRun> &runs = columns[colindex];
+        int y = from;
+        for (auto run = findRun(runs, from); run != runs.end() && run->from < to; ++run) {
+            addRange(y, run->from);
+            if (run->classification <= maxClassification) addRange(std::max<int>(run->from, from), std::min<int>(run->to, to));
+            y = run->to;
+        }
+        addRange(y, to);
+
+        for (const auto &range : ranges) fill(colindex, range.first, range.second, classification);
+    }
+
+    /**
+     * Keeps only the blocks [from, from + size) of every column, moved to
+     * start at zero.
+     */
+    void crop(int from, int size)
+    {
+        for (std::vector<BlockRun> &runs : columns) {
+            size_t kept = 0;
+            for (const BlockRun &run : runs) {
+                int runFrom = std::max<int>(run.from, from) - from;
+                int runTo = std::min<int>(run.to, from + size) - from;
+                if (runFrom >= runTo) continue;
+                runs[kept++] = { static_cast<uint16_t>(runFrom), static_cast<uint16_t>(runTo), run.classification };
+            }
+            runs.resize(kept);
+        }
+        sy = size;
+    }
+};
+
+/**
+ * Quantizes points into the blocks of a box as they are decoded. Only the
+ * points within the height range of the filter are kept in the cloud of all
+ * points, while ground points are all kept for ground fill.
+ */
+class BoxSink : public PointSink
+{
+    PointCloud &all;
+    PointCloud &ground;
+    BlockColumns *blocks;
+    const int sx, sy, sz;
+    const PointFilter &filter;
+
+public:
+    size_t decoded;
+    size_t used;
+    int minHeight;
+    int maxHeight;
+
+    // Store index of each point in the cloud of all points, valid if indexed
+    std::vector<uint32_t> storeIndices;
+    bool indexed;
+
+    // Points are only collected if blocks is null and can be quantized later
+    BoxSink(PointCloud &all, PointCloud &ground, BlockColumns *blocks, int sx, int sy, int sz, const PointFilter &filter) :
+        all(all), ground(ground), blocks(blocks),
+        sx(sx), sy(sy), sz(sz),
+        filter(filter),
+        decoded(0), used(0), minHeight(sy), maxHeight(-1),
+        indexed(true)
+    {}
+
+    void addPoint(const Point &p) override
+    {
+        indexed = false;
+        add(p);
+    }
+
+    void addStorePoint(const Point &p, uint32_t index) override
+    {
+        if (add(p)) storeIndices.push_back(index);
+    }
+
+    // Returns true if the point was added to the cloud of all points
+    bool add(const Point &p)
+    {
+        decoded++;
+        CloudPoint cp = all.toLocal(p);
+        if (blocks) quantize(cp);
+        bool inside = filter.insideHeight(p.z);
+        if (inside) all.addLocalPoint(cp);
+        if (cp.classification == Classification::GROUND) ground.addLocalPoint(cp);
+        return inside;
+    }
+
+    void quantize(const CloudPoint &p)
+    {
+        if (p.classification == Classification::OVERLAP) return;
+
+        int bx = floorDiv(p.x, cloudPointUnitsPerMeter);
+        int by = floorDiv(p.z, cloudPointUnitsPerMeter);
+        int bz = floorDiv(-p.y, cloudPointUnitsPerMeter);
+
+        if (bx < 0 || bx >= sx ||
+            by < 0 || by >= sy ||
+            bz < 0 || bz >= sz) return;
+
+        int colindex = getColumnIndex(bx, bz, sx);
+
+        if (p.classification <= Classification::UNASSIGNED &&
+            blocks->get(colindex, by) > Classification::UNASSIGNED) return;
+
+        blocks->set(colindex, by, p.classification);
+
+        if (by < minHeight) minHeight = by;
+        if (by > maxHeight) maxHeight = by;
+
+        used++;
+    }
+};
+
+/**
+ * Radius search over the points of a box. Points loaded from sections with
+ * a persisted tree are searched through the tree and mapped back to the box
+ * cloud by their store index, only the remaining points use the grid.
+ */
+class BoxSearch
+{
+    struct Section
+    {
+        const SectionSearch *search;
+        // Range of box points loaded from the section
+        size_t begin;
+        size_t end;
+    };
+
+    PointCloud &all;
+    const std::vector<uint32_t> &storeIndices;
+    std::vector<Section> sections;
+
+public:
+    BoxSearch(PointCloud &all, const std::vector<uint32_t> &storeIndices) :
+        all(all), storeIndices(storeIndices)
+    {}
+
+    // Store indices of the range have to be increasing
+    void addSection(const SectionSearch *search, size_t begin, size_t end)
+    {
+        if (begin == end) return;
+        sections.push_back({ search, begin, end });
+    }
+
+    void findRadius(const pcln *center, RadiusResultSet<pcdist, size_t> &results)
+    {
+        // Per thread, so searches can run in parallel
+        static thread_local std::vector<std::pair<uint32_t, pcdist>> sectionResults;
+        for (const Section &section : sections) {
+            RadiusResultSet<pcdist, uint32_t> sectionSet(results.worstDist(), sectionResults);
+            section.search->findRadius(center, sectionSet);
+
+            auto begin = storeIndices.begin() + section.begin;
+            auto end = storeIndices.begin() + section.end;
+            for (const auto &pair : sectionResults) {
+                // Skip points the box did not load, e.g. filtered out ones
+                auto it = std::lower_bound(begin, end, pair.first);
+                if (it == end || *it != pair.first) continue;
+                results.addPoint(pair.second, it - storeIndices.begin());
+            }
+        }
+        all.findRadius(center, results);
+    }
+
+    void findRadius(RadiusBatch &batch, pcdist radius)
+    {
+        batch.run(*this, radius);
+    }
 
+    inline unsigned char getClassification(size_t index) const
+    {
+        return all.getClassification(index);
+    }
 
-static std::mutex boxvisMutex;
+    inline void setClassification(size_t index, unsigned char classification)
+    {
+        all.setClassification(index, classification);
+    }
+};
 
-static void getBounds(const Vec &origin,
-    const int x, const int y, const int z,
-    const int sx, const int sy, const int sz,
-    Vec &bounds_tl, Vec &bounds_br,
-    Vec &bounds_min, Vec &bounds_max
-) {
-    getCoordsFromBlock(origin, x, y, z, bounds_tl);
-    getCoordsFromBlock(origin, x + sx, y + sy, z + sz, bounds_br);
-    bounds_min = bounds_tl.cwiseMin(bounds_br);
-    bounds_max = bounds_tl.cwiseMax(bounds_br);
-}
+/**
+ * Computes the ground height of every column of a box in one pass over the
+ * ground points. Each column takes the height of its ground point closest
+ * to the column center. Columns without ground points take the height of
+ * the closest column with one, up to groundFillDistance columns away, and
+ * are NAN otherwise.
+ */
+static void getGroundHeights(const PointCloud &ground, const Vec &bounds_tl, const int sx, const int sz, std::vector<pcln> &heights)
+{
+    const int sxz = sx*sz;
+    heights.assign(sxz, NAN);
+    std::vector<pcln> centerDists(sxz, INFINITY);
+
+    size_t pointNum = ground.getPointNum();
+    for (size_t i = 0; i < pointNum; i++) {
+        Point p = ground.getPoint(i);
+        pcln lx = p.x - bounds_tl.x();
+        pcln lz = bounds_tl.y() - p.y;
+        int bx = static_cast<int>(floor(lx));
+        int bz = static_cast<int>(floor(lz));
+        if (bx < 0 || bx >= sx || bz < 0 || bz >= sz) continue;
+
+        pcln dx = lx - bx - 0.5;
+        pcln dz = lz - bz - 0.5;
+        pcln dist = dx*dx + dz*dz;
+        int colindex = getColumnIndex(bx, bz, sx);
+        if (dist < centerDists[colindex]) {
+            centerDists[colindex] = dist;
+            heights[colindex] = p.z;
+        }
+    }
 
+    // Nearest column propagation as a breadth-first search from all the
+    // columns with ground at once
+    std::vector<int> front;
+    std::vector<int> next;
+    for (int i = 0; i < sxz; i++) {
+        if (!isnan(heights[i])) front.push_back(i);
+    }
+    if (front.empty()) return;
+
+    for (int step = 0; step < groundFillDistance && !front.empty(); step++) {
+        next.clear();
+        for (int colindex : front) {
+            int bx = colindex % sx;
+            int bz = colindex / sx;
+            for (int nz = std::max(0, bz - 1); nz <= std::min(sz - 1, bz + 1); nz++) {
+                for (int nx = std::max(0, bx - 1); nx <= std::min(sx - 1, bx + 1); nx++) {
+                    int neighbor = getColumnIndex(nx, nz, sx);
+                    if (!isnan(heights[neighbor])) continue;
+                    heights[neighbor] = heights[colindex];
+                    next.push_back(neighbor);
+                }
+            }
+        }
+        front.swap(next);
+    }
+}
 
+/**
+ * Calls fn(from, to) for consecutive ranges of rows covering [0, rows),
+ * spread over the workers if boxes are processed in parallel.
+ */
+static void runBoxRows(int rows, const std::function<void(int, int)> &fn)
+{
+    int chunks = parallelBoxes ? std::min(rows, (workers.size() + 1) * 2) : 1;
+    if (chunks <= 1) {
+        fn(0, rows);
+        return;
+    }
+    workers.run(chunks, [&](int i) {
+        fn(rows * i / chunks, rows * (i + 1) / chunks);
+    });
+}
 
 // Position and size of the requested box (all block coordinates)
-// Returns mutex locked box (unlock when done)
-BoxResult& getBox(const BoxType type, const uint32_t worldHash, Vec origin, const long x, long y, const long z, const long sx, long sy, const long sz, const bool debug, const bool transform) {
+// Returns a reference to the box with its BoxResult::mutex locked, the
+// caller has to unlock it when done
+BoxCache::BoxRef getBox(const BoxType type, const uint32_t worldHash, Vec origin, const long x, long y, const long z, const long sx, long sy, const long sz, const bool debug, const bool transform) {
 
-    if (sx <= 0 || sy <= 0 || sz <= 0) return invalidBoxResult;
+    if (sx <= 0 || sy <= 0 || sz <= 0) return nullptr;
 
     // Power of 2 sizes
     int psx = (int)log2(sx);
     int psy = (int)log2(sy);
     int psz = (int)log2(sz);
-    // Size mask per dimension
-    int msx = sx - 1;
-    int msy = sy - 1;
-    int msz = sz - 1;
 
     // Box coordinates
     int bx = x >> psx;
@@ -2945,8 +6420,9 @@ BoxResult& getBox(const BoxType type, const uint32_t worldHash, Vec origin, cons
     //       //
 
     // Try cached box
-    unsigned int boxHashCode;
-    BoxResult &br = boxHash.at(bx, bz, boxHashCode);
+    BoxKey key = { type, worldHash, origin, x, y, z, sx, sy, sz, transform };
+    BoxCache::BoxRef boxRef = boxCache.get(key);
+    BoxResult &br = *boxRef;
 
     // Exclusive box access
     //std::lock_guard<std::mutex> brLock(br.mutex);
@@ -2957,13 +6433,17 @@ BoxResult& getBox(const BoxType type, const uint32_t worldHash, Vec origin, cons
     br.access = access;
 
     // Return cached if found
-    if (!debug && br.valid &&
-        br.type == type &&
-        br.origin == origin &&
-        br.x == x && br.y == y && br.z == z &&
-        br.sx == sx && br.sy == sy && br.sz == sz &&
-        br.transformed == transform) {
-        return br;
+    if (!debug && br.valid) {
+        return boxRef;
+    }
+
+    // Return stored on disk by an earlier run if found and its sections
+    // haven't changed since
+    uint64_t sourceStamp = boxDisk.isOpen() ? getBoxSourceStamp(origin, x, y, z, sx, sy, sz) : 0;
+    if (!debug && boxDisk.read(key, sourceStamp, br)) {
+        br.valid = true;
+        boxCache.update(key, boxRef);
+        return boxRef;
     }
 
     dtimer("box generation");
@@ -2973,7 +6453,6 @@ BoxResult& getBox(const BoxType type, const uint32_t worldHash, Vec origin, cons
     //         //
 
     // Not found in cache, update cached params
-    if (!br.valid) ++boxesCached;
     br.type = type;
     br.valid = false;
     br.origin = origin;
@@ -2984,12 +6463,15 @@ BoxResult& getBox(const BoxType type, const uint32_t worldHash, Vec origin, cons
     br.sy = sy;
     br.sz = sz;
     br.transformed = transform;
+    br.worldHash = worldHash;
 
     // Precomputed strides
-    int sxyz = sx*sy*sz;
     int sxz = sx*sz;
 
-    std::vector<unsigned int> blocks(sxyz, 0);
+    // Classifications of the blocks as runs while processing, mapped to
+    // blocks in the y-major layout of the result at the end
+    BlockColumns classes(sx, sy, sz);
+    std::vector<unsigned int> blocks;
     std::vector<unsigned int> columns(sxz, 0);
     std::vector<unsigned int> groundCols(sxz, 0);
 
@@ -3037,57 +6519,110 @@ BoxResult& getBox(const BoxType type, const uint32_t worldHash, Vec origin, cons
     int seaDummy, seaY;
     getBlockFromCoords(bounds_tl, Vec(0, 0, seaThreshold), seaDummy, seaY, seaDummy);
 
-    PointCloud all(50);
-    PointCloud ground(20);
+    // Both clouds are relative to the box corner, so quantization below can
+    // work on exact integer offsets
+    PointCloud all(bounds_tl);
+    PointCloud ground(bounds_tl);
+    std::vector<uint32_t> storeIndices;
+    BoxSearch allSearch(all, storeIndices);
+    // Points loaded through section trees come first in the cloud of all points
+    size_t treeNum = 0;
+    // Reused by the radius queries of all stages
+    RadiusBatch batch;
 
     MapCloudRef cornerClouds[4];
 
     {
-        //            //
-        // Point load //
-        //            //
+        //                             //
+        // Point load and quantization //
+        //                             //
         dtimer("point load");
 
-        int count = getCornerMapClouds(cornerClouds, bounds_min, bounds_max);
-        for (int i = 0; i < 4; i++) {
-            MapCloud* mc = cornerClouds[i].cloud;
-            if (!mc) continue;
-            mc->load(&all, &ground, bounds_min.x(), bounds_min.y(), bounds_max.x(), bounds_max.y(), transform);
-        }
-    }
-
-    {
-        //              //
-        // Quantization //
-        //              //
-        dtimer("quantization");
-        size_t num = all.getPointNum();
-        pointsLoaded += num;
-
-        for (size_t i = 0; i < num; i++) {
-            Point &p = all.getPoint(i);
+        PointFilter filter = getBoxFilter(bounds_tl, sy);
+        BoxSink sink(all, ground, &classes, sx, sy, sz, filter);
 
-            if (p.classification == Classification::OVERLAP) continue;
+        // Section trees index untransformed store points only
+        bool treeSearch = useTrees && !transform;
 
-            int bx, by, bz;
-            getBlockFromCoords(bounds_tl, p, bx, by, bz);
-
-            if (bx < 0 || bx >= sx ||
-                by < 0 || by >= sy ||
-                bz < 0 || bz >= sz) continue;
-
-            int index = getBlockIndex(bx, by, bz, sx, sxz);
-
-            if (p.classification <= Classification::UNASSIGNED &&
-                blocks[index] > Classification::UNASSIGNED) continue;
+        int count = getCornerMapClouds(cornerClouds, bounds_min, bounds_max);
+        std::vector<size_t> tileBegin(4, 0);
+        std::vector<size_t> tileEnd(4, 0);
+        if (count <= 1) {
+            for (int i = 0; i < 4; i++) {
+                MapCloud* mc = cornerClouds[i].cloud;
+                if (!mc) continue;
+                if (!mc->getSearch()) treeSearch = false;
+                tileBegin[i] = all.getPointNum();
+                mc->load(sink, bounds_min.x(), bounds_min.y(), bounds_max.x(), bounds_max.y(), transform, filter);
+                tileEnd[i] = all.getPointNum();
+            }
+            if (!sink.indexed) treeSearch = false;
+            if (treeSearch) storeIndices.swap(sink.storeIndices);
+        } else {
+            ++boxesMultiTile;
+
+            // Load each section into its own clouds in parallel and
+            // merge them in corner order, so the result is the same as
+            // loading them one after another
+            std::vector<std::unique_ptr<PointCloud>> tileAll(4);
+            std::vector<std::unique_ptr<PointCloud>> tileGround(4);
+            std::vector<std::vector<uint32_t>> tileIndices(4);
+            std::vector<size_t> tileDecoded(4, 0);
+            std::vector<char> tileIndexed(4, true);
+            workers.run(4, [&](int i) {
+                MapCloud* mc = cornerClouds[i].cloud;
+                if (!mc) return;
+                tileAll[i].reset(new PointCloud(bounds_tl));
+                tileGround[i].reset(new PointCloud(bounds_tl));
+                BoxSink tileSink(*tileAll[i], *tileGround[i], nullptr, sx, sy, sz, filter);
+                mc->load(tileSink, bounds_min.x(), bounds_min.y(), bounds_max.x(), bounds_max.y(), transform, filter);
+                tileDecoded[i] = tileSink.decoded;
+                tileIndexed[i] = tileSink.indexed && mc->getSearch();
+                tileIndices[i].swap(tileSink.storeIndices);
+            });
+
+            size_t allNum = 0, groundNum = 0;
+            for (int i = 0; i < 4; i++) {
+                if (!tileAll[i]) continue;
+                allNum += tileAll[i]->getPointNum();
+                groundNum += tileGround[i]->getPointNum();
+            }
+            all.pts.reserve(allNum);
+            ground.pts.reserve(groundNum);
+            for (int i = 0; i < 4; i++) {
+                if (!tileAll[i]) continue;
+                if (!tileIndexed[i]) treeSearch = false;
+            }
+            if (treeSearch) storeIndices.reserve(allNum);
+            for (int i = 0; i < 4; i++) {
+                if (!tileAll[i]) continue;
+                tileBegin[i] = all.getPointNum();
+                all.append(*tileAll[i]);
+                tileEnd[i] = all.getPointNum();
+                ground.append(*tileGround[i]);
+                sink.decoded += tileDecoded[i];
+                if (treeSearch) storeIndices.insert(storeIndices.end(), tileIndices[i].begin(), tileIndices[i].end());
+            }
 
-            blocks[index] = p.classification;
+            // Quantization order has to match the load order
+            dtimer("quantization");
+            for (const CloudPoint &p : all.pts) sink.quantize(p);
+        }
 
-            if (by < minHeight) minHeight = by;
-            if (by > maxHeight) maxHeight = by;
-            
-            pointsUsed++;
+        if (treeSearch) {
+            ++boxesTreeSearched;
+            for (int i = 0; i < 4; i++) {
+                MapCloud* mc = cornerClouds[i].cloud;
+                if (!mc) continue;
+                allSearch.addSection(mc->getSearch(), tileBegin[i], tileEnd[i]);
+            }
+            treeNum = all.getPointNum();
         }
+
+        pointsLoaded += sink.decoded;
+        pointsUsed = sink.used;
+        minHeight = sink.minHeight;
+        maxHeight = sink.maxHeight;
     }
 
     {
@@ -3109,6 +6644,9 @@ BoxResult& getBox(const BoxType type, const uint32_t worldHash, Vec origin, cons
             pcln heightSum = 0;
             int heightNum = 0;
 
+            // Specialization reads the packed raster of each map cloud, so
+            // neighbouring columns share their pixel votes without a
+            // per-box raster
             for (int iz = 0; iz < sz; iz++) {
                 for (int ix = 0; ix < sx; ix++) {
                     getCoordsFromBlock(bounds_tl, ix, 0, iz, query_block_center);
@@ -3175,22 +6713,12 @@ BoxResult& getBox(const BoxType type, const uint32_t worldHash, Vec origin, cons
                 maxHeight = std::min((int)sy - 1, std::max(0, maxHeight));
                 minHeight = std::min((int)sy - 1, std::max(0, minHeight));
 
-                int height = std::min(maxHeight, std::max(minHeight, waterHeight));
-                
-                for (int iy = minHeight; iy <= maxHeight; iy++) {
-                    int bid = iy == minHeight ?
-                        classificationToBlock(Classification::GROUND) :
-                        classificationToBlock(Classification::WATER);
-
-                    for (int iz = 0; iz < sz; iz++) {
-                        for (int ix = 0; ix < sx; ix++) {
-                            int index = getBlockIndex(ix, iy, iz, sx, sxz);
-                            blocks[index] = bid;
-                            extendColumn(ix, iy, iz, sx, columns.data(), &minHeight, &maxHeight);
-                        }
-                    }
-
+                // Every column is the same, ground with water on top
+                for (int colindex = 0; colindex < sxz; colindex++) {
+                    classes.fill(colindex, minHeight, minHeight + 1, Classification::GROUND);
+                    classes.fill(colindex, minHeight + 1, maxHeight + 1, Classification::WATER);
                 }
+                std::fill(columns.begin(), columns.end(), maxHeight);
                 //*/
             }
         }
@@ -3215,13 +6743,9 @@ BoxResult& getBox(const BoxType type, const uint32_t worldHash, Vec origin, cons
 
             // Shrink box to required height
             if (rsy < sy) {
-                int reqFrom = getBlockIndex(0, ry, 0, sx, sxz);
-                int reqTo = getBlockIndex(0, ry + rsy, 0, sx, sxz);
-                blocks.erase(blocks.begin() + reqTo, blocks.end());
-                blocks.erase(blocks.begin(), blocks.begin() + reqFrom);
+                classes.crop(ry, rsy);
                 sy = rsy;
                 y += ry;
-                sxyz = sxz*sy;
 
                 getBounds(origin, x, y, z, sx, sy, sz, bounds_tl, bounds_br, bounds_min, bounds_max);
                 getBlockFromCoords(bounds_tl, Vec(0, 0, seaThreshold), seaDummy, seaY, seaDummy);
@@ -3231,15 +6755,17 @@ BoxResult& getBox(const BoxType type, const uint32_t worldHash, Vec origin, cons
         }
     }
 
-    if (pointsUsed == 0 && maxHeight == -1) {
-        blocks.resize(0);
-    }
+    // Boxes without any blocks have no block data
+    bool empty = pointsUsed == 0 && maxHeight == -1;
 
-    unsigned int *cblocks = blocks.data();
+    // Guards the height range of parallel stages
+    std::mutex heightMutex;
     
     // Process points if any found
     if (pointsUsed > 0) {
 
+        batch.parallel = parallelBoxes;
+
         /*
         {
             //                                      //
@@ -3270,20 +6796,29 @@ BoxResult& getBox(const BoxType type, const uint32_t worldHash, Vec origin, cons
             // Initialize columns //
             //                    //
             dtimer("columns");
-            for (int i = 0; i < sxyz; i++) {
-                unsigned int &cv = cblocks[i];
-
-                if (cv != 0) {
-                    int bx = i & msx;
-                    int bz = (i >> psx) & msz;
-                    int by = (i >> psx) >> psz;
-
-                    extendColumn(bx, by, bz, sx, columns.data(), &minHeight, &maxHeight);
-                    if (cv == Classification::GROUND || cv == Classification::WATER) {
-                        extendColumn(bx, by, bz, sx, groundCols.data());
+            runBoxRows(sz, [&](int fromZ, int toZ) {
+                int rowsMinHeight = minHeight;
+                int rowsMaxHeight = maxHeight;
+                for (int bz = fromZ; bz < toZ; bz++) {
+                    for (int bx = 0; bx < sx; bx++) {
+                        const std::vector<BlockRun> &runs = classes.getRuns(getColumnIndex(bx, bz, sx));
+                        if (runs.empty()) continue;
+
+                        // Only the lowest and highest blocks matter
+                        extendColumn(bx, runs.front().from, bz, sx, columns.data(), &rowsMinHeight, &rowsMaxHeight);
+                        extendColumn(bx, runs.back().to - 1, bz, sx, columns.data(), &rowsMinHeight, &rowsMaxHeight);
+                        for (auto run = runs.rbegin(); run != runs.rend(); ++run) {
+                            if (run->classification == Classification::GROUND || run->classification == Classification::WATER) {
+                                extendColumn(bx, run->to - 1, bz, sx, groundCols.data());
+                                break;
+                            }
+                        }
                     }
                 }
-            }
+                std::lock_guard<std::mutex> lock(heightMutex);
+                minHeight = std::min(minHeight, rowsMinHeight);
+                maxHeight = std::max(maxHeight, rowsMaxHeight);
+            });
         }
         //*/
 
@@ -3294,44 +6829,40 @@ BoxResult& getBox(const BoxType type, const uint32_t worldHash, Vec origin, cons
             //               //
             dtimer("building fill");
 
-            for (int i = 0; i < sxyz; i++) {
-                unsigned int &cv = cblocks[i];
-                if (cv == Classification::BUILDING) {
-
-                    int bx, by, bz;
-
-                    getIndexBlock(i, bx, by, bz, sx, sz);
-
-                    int index = i - sxz;
-                    int iy = by - 1;
-                    while (iy > minHeight) {
-                        cblocks[index] = Classification::BUILDING;
-                        index -= sxz;
-                        iy--;
+            // Every building block fills the column below it, so only the
+            // highest one matters
+            runBoxRows(sz, [&](int fromZ, int toZ) {
+                for (int bz = fromZ; bz < toZ; bz++) {
+                    for (int bx = 0; bx < sx; bx++) {
+                        int colindex = getColumnIndex(bx, bz, sx);
+                        const std::vector<BlockRun> &runs = classes.getRuns(colindex);
+                        for (auto run = runs.rbegin(); run != runs.rend(); ++run) {
+                            if (run->classification != Classification::BUILDING) continue;
+                            classes.fill(colindex, minHeight + 1, run->to - 1, Classification::BUILDING);
+                            extendColumn(bx, minHeight, bz, sx, groundCols.data());
+                            break;
+                        }
                     }
-
-                    extendColumn(bx, minHeight, bz, sx, groundCols.data());
                 }
-            }
+            });
         }
         //*/
 
-        {
-            //                       //
-            // Spatial tree (ground) //
-            //                       //
-            dtimer("kdtree ground");
-            ground.build();
-        }
-
-
         //*
         {
             //             //
             // Ground fill //
             //             //
             dtimer("ground fill");
-            dtimerInit(ground_search, "ground search");
+
+            std::vector<pcln> groundHeights;
+            {
+                dtimer("ground heights");
+                getGroundHeights(ground, bounds_tl, sx, sz, groundHeights);
+            }
+
+            MapCloud* corners[4];
+            setCornersFromRefs(cornerClouds, corners);
 
             Vec block_center; block_center << 0.5, 0.5, 0.5;
 
@@ -3344,54 +6875,27 @@ BoxResult& getBox(const BoxType type, const uint32_t worldHash, Vec origin, cons
 
                     int bx = ix, bz = iz;
                     int by = 0;
-                    bool found = false;
-
-                    {
-                        dtimerStart(ground_search);
-
-                        const double min_diff = 0.5;
-
-                        const int max_iters = 10;
-                        Vec query_block_center;
-                        size_t ret_index;
-                        pcln out_dist_sqr;
-                        pcln diff = min_diff + 1;
-                        Point *point;
-                        getCoordsFromBlock(bounds_tl, bx, by, bz, query_block_center);
-                        query_block_center += block_center;
-
-                        int i = 0;
-                        //for (i = 0; i < num_iters; i++) {
-                        for (i = 0; i < max_iters && diff > min_diff; i++) {
-                            found = ground.findNearest(query_block_center.data(), ret_index, out_dist_sqr);
-
-                            if (!found) break;
 
-                            point = &ground.getPoint(ret_index);
-                            diff = abs(query_block_center.z() - point->z);
-                            query_block_center.z() = point->z;
+                    Vec query_block_center;
+                    getCoordsFromBlock(bounds_tl, bx, by, bz, query_block_center);
+                    query_block_center += block_center;
 
-                            //br.exportWrite(query_block_center.x() - bounds_tl.x(), query_block_center.z() - bounds_tl.z(), query_block_center.y() - bounds_tl.y(), -50 - i);
-                            br.exportWrite(query_block_center.x() - bounds_tl.x(), i * 5, query_block_center.y() - bounds_tl.y(), -100 - i);
-                        }
+                    Point p;
+                    p.x = query_block_center.x();
+                    p.y = query_block_center.y();
+                    p.z = groundHeights[colindex];
+                    p.classification = Classification::GROUND;
 
-                        if (i > 0) {
-                            getBlockFromCoords(bounds_tl, *point, bx, by, bz);
-                            bx = ix;
-                            bz = iz;
-                            //br.exportWrite(bx + 0.5, by + 0.5, bz + 0.5, -50);
-                            found = true;
-                        }
+                    // No ground nearby, fall back to the relief model
+                    if (isnan(p.z)) {
+                        p.z = MapCloud::getHeight(corners, p.x, p.y);
+                        if (transform && !isnan(p.z)) transformPoint(p);
+                    }
 
-                        if (found) {
-                            Point p;
-                            p.x = query_block_center.x();
-                            p.y = query_block_center.y();
-                            p.z = point->z;
-                            all.addPoint(p);
-                        }
+                    if (!isnan(p.z)) {
+                        all.addPoint(p);
 
-                        dtimerStop(ground_search);
+                        getBlockFromCoords(bounds_tl, p, bx, by, bz);
                     }
 
                     by = by < 0 ? 0 :
@@ -3409,37 +6913,38 @@ BoxResult& getBox(const BoxType type, const uint32_t worldHash, Vec origin, cons
 
             {
                 dtimer("ground set");
-                for (int iy = 0; iy < sy; iy++) {
-                    for (int iz = 0; iz < sz; iz++) {
+                runBoxRows(sz, [&](int fromZ, int toZ) {
+                    int rowsMinHeight = minHeight;
+                    int rowsMaxHeight = maxHeight;
+                    for (int iz = fromZ; iz < toZ; iz++) {
                         for (int ix = 0; ix < sx; ix++) {
-                            int index = getBlockIndex(ix, iy, iz, sx, sxz);
                             int colindex = getColumnIndex(ix, iz, sx);
-                            int col = groundCols[colindex];
-                            if (iy <= col) {
-                                unsigned int &cv = cblocks[index];
-
-                                if (iy <= seaY) {
-                                    cv = Classification::WATER;
-                                } else if (cv <= Classification::UNASSIGNED) {
-                                    cv = Classification::GROUND;
-                                }
-                                
-                                extendColumn(ix, iy, iz, sx, columns.data(), &minHeight, &maxHeight);
-                            }
+                            int col = std::min((int)groundCols[colindex], (int)sy - 1);
+
+                            // Water up to the sea level, unclassified blocks above it are ground
+                            int seaTop = std::min(seaY, col);
+                            classes.fill(colindex, 0, seaTop + 1, Classification::WATER);
+                            classes.fillBelowClass(colindex, std::max(seaTop + 1, 0), col + 1, Classification::UNASSIGNED, Classification::GROUND);
+
+                            extendColumn(ix, 0, iz, sx, columns.data(), &rowsMinHeight, &rowsMaxHeight);
+                            extendColumn(ix, col, iz, sx, columns.data(), &rowsMinHeight, &rowsMaxHeight);
                         }
                     }
-                }
+                    std::lock_guard<std::mutex> lock(heightMutex);
+                    minHeight = std::min(minHeight, rowsMinHeight);
+                    maxHeight = std::max(maxHeight, rowsMaxHeight);
+                });
             }
 
         }
         //*/
 
         {
-            //                    //
-            // Spatial tree (all) //
-            //                    //
-            dtimer("kdtree all");
-            all.build();
+            //                      //
+            // Neighbour grid (all) //
+            //                      //
+            dtimer("grid all");
+            all.build(treeNum);
         }
 
 
@@ -3449,39 +6954,68 @@ BoxResult& getBox(const BoxType type, const uint32_t worldHash, Vec origin, cons
             // Specialization //
             //                //
             dtimer("specialization");
+
+            // Map lookups only read the map, so columns are classified in
+            // parallel and then applied to the point cloud in a batch
+            std::vector<Classification> specialized(sxz, Classification::NONE);
+            runBoxRows(sz, [&](int fromZ, int toZ) {
+                for (int iz = fromZ; iz < toZ; iz++) {
+                    for (int ix = 0; ix < sx; ix++) {
+
+                        int bx = ix;
+                        int bz = iz;
+                        int colindex = getColumnIndex(bx, bz, sx);
+                        int by = columns[colindex];
+                        int c = classes.get(colindex, by);
+
+                        ClassificationQuery cq;
+                        Point cq_point;
+                        getCoordsFromBlock(bounds_tl, bx, by, bz, cq_point);
+                        cq.x = cq_point.x;
+                        cq.y = cq_point.y;
+                        setCornersFromRefs(cornerClouds, cq.corners);
+                        cq.lidar = static_cast<Classification>(c);
+                        MapCloud *mapCloud;
+                        int mx;
+                        int my;
+                        specialized[colindex] = MapCloud::getSpecializedClassification(cq, &mapCloud, &mx, &my);
+                    }
+                }
+            });
+
+            batch.clear();
+            std::vector<int> batchClasses;
+
+            Vec block_center; block_center << 0.5, 0.5, 0.5;
+            Vec query_block_center;
+
             for (int iz = 0; iz < sz; iz++) {
                 for (int ix = 0; ix < sx; ix++) {
 
                     int bx = ix;
                     int bz = iz;
                     int colindex = getColumnIndex(bx, bz, sx);
-                    int by = columns[colindex];
-                    int index = getBlockIndex(bx, by, bz, sx, sxz);
-                    unsigned int &cv = cblocks[index];
-                    int c = cv & 0xFF;
-
-                    ClassificationQuery cq;
-                    Point cq_point;
-                    getCoordsFromBlock(bounds_tl, bx, by, bz, cq_point);
-                    cq.x = cq_point.x;
-                    cq.y = cq_point.y;
-                    setCornersFromRefs(cornerClouds, cq.corners);
-                    cq.lidar = static_cast<Classification>(c);
-                    MapCloud *mapCloud;
-                    int mx;
-                    int my;
-                    Classification sc = MapCloud::getSpecializedClassification(cq, &mapCloud, &mx, &my);
+                    Classification sc = specialized[colindex];
                     if (sc == Classification::NONE) continue;
 
-                    cv = sc;
+                    int by = columns[colindex];
+                    classes.set(colindex, by, sc);
 
                     //br.jsonWrite(bx, by, bz, -1);
 
+                    getCoordsFromBlock(bounds_tl, bx, by, bz, query_block_center);
+                    query_block_center += block_center;
+                    batch.addQuery(query_block_center);
+                    batchClasses.push_back(sc);
+                }
+            }
 
-                    // Apply specialization to point cloud
-                    applyBlockToCloud(bounds_tl, bx, by, bz, (Classification)cv, &all);
-                    applyBlockToCloud(bounds_tl, bx, by, bz, (Classification)cv, &ground);
-
+            // Apply specialization to the point cloud in column order
+            const pcdist radius = static_cast<pcdist>(M_SQRT2);
+            allSearch.findRadius(batch, radius);
+            for (size_t q = 0; q < batch.getQueryNum(); q++) {
+                for (auto it = batch.begin(q); it != batch.end(q); ++it) {
+                    allSearch.setClassification(it->first, batchClasses[q]);
                 }
             }
         }
@@ -3497,76 +7031,179 @@ BoxResult& getBox(const BoxType type, const uint32_t worldHash, Vec origin, cons
             Vec block_center; block_center << 0.5, 0.5, 0.5;
             Vec query_block_center;
 
+            struct FilterColumn
+            {
+                int bx, by, bz;
+                int colindex;
+            };
+            std::vector<FilterColumn> filterColumns;
+            std::vector<uint32_t> sourceColumns;
+            std::vector<uint32_t> tileStart;
+            std::vector<uint32_t> tileFill;
+            std::vector<uint32_t> tileColumns;
+            std::vector<int> waveTiles;
+
+            // Columns only change their own classification, so a column is
+            // only ever filtered if it starts out as a source of any filter
+            bool filterSource[256] = {};
+            pcln filterRadiusMax = 0;
+            for (auto &filter : classificationFilters) {
+                for (Classification source : filter.sources) filterSource[source] = true;
+                filterRadiusMax = std::max(filterRadiusMax, filter.radius);
+            }
+
+            // The query centers on top of the columns stay the same for all
+            // filters, so the neighbours are gathered once at the largest
+            // radius and every filter takes the closest ones within its own
+            batch.clear();
+            for (int iz = 0; iz < sz; iz++) {
+                for (int ix = 0; ix < sx; ix++) {
+
+                    int bx = ix;
+                    int bz = iz;
+                    int colindex = getColumnIndex(bx, bz, sx);
+                    int by = columns[colindex];
+                    int c = classes.get(colindex, by);
+
+                    if (!filterSource[c]) continue;
+
+                    getCoordsFromBlock(bounds_tl, bx, by, bz, query_block_center);
+                    query_block_center += block_center;
+                    batch.addQuery(query_block_center);
+                    filterColumns.push_back({ bx, by, bz, colindex });
+                }
+            }
+
+            allSearch.findRadius(batch, static_cast<pcdist>(filterRadiusMax));
+            batch.sortByDistance();
+
+            int filterIndex = 0;
             for (auto &filter : classificationFilters) {
                 dtimer(filter.name.c_str());
-                for (int iz = 0; iz < sz; iz++) {
-                    for (int ix = 0; ix < sx; ix++) {
+                RuntimeCounter &changedCounter = *filterCounters.changed[filterIndex++];
+
+                sourceColumns.clear();
+                for (size_t q = 0; q < filterColumns.size(); q++) {
+                    const FilterColumn &column = filterColumns[q];
+                    int c = classes.get(column.colindex, column.by);
+                    if (std::find(filter.sources.begin(), filter.sources.end(), c) == filter.sources.end()) continue;
+                    sourceColumns.push_back(static_cast<uint32_t>(q));
+                }
 
-                        int bx = ix;
-                        int bz = iz;
-                        int colindex = getColumnIndex(bx, bz, sx);
-                        int by = columns[colindex];
-                        int index = getBlockIndex(bx, by, bz, sx, sxz);
-                        unsigned int &cv = cblocks[index];
-                        int c = cv & 0xFF;
-
-                        if (std::find(filter.sources.begin(), filter.sources.end(), c) == filter.sources.end()) continue;
-
-                        getCoordsFromBlock(bounds_tl, bx, by, bz, query_block_center);
-                        query_block_center += block_center;
-
-                        const Classification target = filter.target;
-                        const pcln radius = filter.radius;
-                        const pcln thresholdRatio = filter.thresholdRatio;
-
-                        std::vector<std::pair<size_t, pcln> > indices;
-                        RadiusResultSet<pcln, size_t> points(radius*radius, indices);
-                        all.findRadius(query_block_center.data(), points);
-
-                        int sourcePoints = 0;
-                        int targetPoints = 0;
-
-                        bool targetClosest = target == Classification::NONE;
-                        pcln minDist = INFINITY;
-                        size_t minIndex = -1;
-
-                        for (size_t in = 0; in < points.size(); in++) {
-                            std::pair<size_t, pcln> pair = points.m_indices_dists[in];
-                            Point &p = all.getPoint(pair.first);
-
-                            if (p.classification != Classification::NONE && p.classification != Classification::UNASSIGNED) {
-                                bool isTarget = targetClosest || p.classification == target;
-                                bool isSource = p.classification == c;
-                                if (isTarget) targetPoints++;
-                                if (isSource) sourcePoints++;
-                                if (targetClosest && !isSource && pair.second < minDist) {
-                                    minDist = pair.second;
-                                    minIndex = pair.first;
-                                }
+                const Classification target = filter.target;
+                const pcln radius = filter.radius;
+                const pcln thresholdRatio = filter.thresholdRatio;
+
+                auto filterColumn = [&](size_t q) {
+                    const FilterColumn &column = filterColumns[q];
+                    uint8_t cv = classes.get(column.colindex, column.by);
+                    int c = cv;
+
+                    const std::pair<size_t, pcdist> *neighboursEnd = batch.end(q, static_cast<pcdist>(radius));
+                    size_t pointNum = neighboursEnd - batch.begin(q);
+
+                    int sourcePoints = 0;
+                    int targetPoints = 0;
+
+                    bool targetClosest = target == Classification::NONE;
+                    pcdist minDist = INFINITY;
+                    size_t minIndex = -1;
+
+                    for (auto it = batch.begin(q); it != neighboursEnd; ++it) {
+                        const std::pair<size_t, pcdist> &pair = *it;
+                        unsigned char pc = allSearch.getClassification(pair.first);
+
+                        if (pc != Classification::NONE && pc != Classification::UNASSIGNED) {
+                            bool isTarget = targetClosest || pc == target;
+                            bool isSource = pc == c;
+                            if (isTarget) targetPoints++;
+                            if (isSource) sourcePoints++;
+                            if (targetClosest && !isSource && pair.second < minDist) {
+                                minDist = pair.second;
+                                minIndex = pair.first;
                             }
                         }
-                        
-                        
-                        pcln targetTotalRatio = points.size() > 0 ? ((pcln)targetPoints / points.size()) : 0;
-                        pcln diffRatio = points.size() > 0 ? ((pcln)targetPoints - sourcePoints) / points.size() : 0;
-
-                        bool changed = false;
-                        if (diffRatio > thresholdRatio) {
-                            if (targetClosest) {
-                                if (!isinf(minDist)) {
-                                    cv = all.getPoint(minIndex).classification;
-                                    changed = true;
-                                }
-                            } else {
-                                cv = target;
+                    }
+
+                    pcln targetTotalRatio = pointNum > 0 ? ((pcln)targetPoints / pointNum) : 0;
+                    pcln diffRatio = pointNum > 0 ? ((pcln)targetPoints - sourcePoints) / pointNum : 0;
+
+                    bool changed = false;
+                    if (diffRatio > thresholdRatio) {
+                        if (targetClosest) {
+                            if (!isinf(minDist)) {
+                                cv = allSearch.getClassification(minIndex);
                                 changed = true;
                             }
+                        } else {
+                            cv = target;
+                            changed = true;
                         }
+                    }
+
+                    if (changed) {
+                        ++changedCounter;
+                        classes.set(column.colindex, column.by, cv);
+                        applyBlockToCloud(bounds_tl, column.bx, column.by, column.bz, (Classification)cv, &allSearch);
+                    }
+                };
+
+                size_t queryNum = sourceColumns.size();
+                if (!parallelBoxes) {
+                    for (uint32_t q : sourceColumns) filterColumn(q);
+                    continue;
+                }
 
-                        if (changed) applyBlockToCloud(bounds_tl, bx, by, bz, (Classification)cv, &all);
+                // Columns depend on the reclassified points of the columns
+                // before them within the query and reclassification radius,
+                // which are less than stride columns away. Rows are split into
+                // tiles of stride columns, each filtered in serial order, and
+                // tile tx of row bz runs in wave tx + 2*bz. That keeps every
+                // such pair in serial order, while the tiles of one wave are
+                // at least stride columns apart and touch disjoint points, so
+                // the output stays the same.
+                const int stride = static_cast<int>(ceil(std::max(radius, (pcln)M_SQRT2) + M_SQRT2));
+                const int tilesX = (sx + stride - 1) / stride;
+                const int tileNum = tilesX*sz;
+                const int waveNum = tilesX + 2*(sz - 1);
+                tileStart.assign(tileNum + 1, 0);
+                for (uint32_t q : sourceColumns) {
+                    const FilterColumn &column = filterColumns[q];
+                    tileStart[column.bx / stride + tilesX*column.bz + 1]++;
+                }
+                for (int t = 0; t < tileNum; t++) tileStart[t + 1] += tileStart[t];
+                tileColumns.resize(queryNum);
+                tileFill.assign(tileStart.begin(), tileStart.end() - 1);
+                for (uint32_t q : sourceColumns) {
+                    const FilterColumn &column = filterColumns[q];
+                    tileColumns[tileFill[column.bx / stride + tilesX*column.bz]++] = q;
+                }
 
+                auto filterTile = [&](int t) {
+                    for (uint32_t i = tileStart[t]; i < tileStart[t + 1]; i++) filterColumn(tileColumns[i]);
+                };
+
+                for (int w = 0; w < waveNum; w++) {
+                    waveTiles.clear();
+                    uint32_t waveColumnNum = 0;
+                    int bzMin = std::max(0, (w - tilesX + 2) / 2);
+                    int bzMax = std::min(static_cast<int>(sz) - 1, w / 2);
+                    for (int bz = bzMin; bz <= bzMax; bz++) {
+                        int t = w - 2*bz + tilesX*bz;
+                        uint32_t count = tileStart[t + 1] - tileStart[t];
+                        if (count == 0) continue;
+                        waveTiles.push_back(t);
+                        waveColumnNum += count;
                     }
 
+                    // Waking the workers costs more than filtering a few columns
+                    if (waveTiles.size() < 2 || waveColumnNum < filterWaveColumnsMin) {
+                        for (int t : waveTiles) filterTile(t);
+                        continue;
+                    }
+                    workers.run(static_cast<int>(waveTiles.size()), [&](int i) {
+                        filterTile(waveTiles[i]);
+                    });
                 }
             }
         }
@@ -3582,38 +7219,24 @@ BoxResult& getBox(const BoxType type, const uint32_t worldHash, Vec origin, cons
             //                    //
             dtimer("water equalization");
 
-            Vec block_center; block_center << 0.5, 0.5, 0.5;
-            Vec query_block_center;
-
-
-            int minHeight = std::numeric_limits<int>::max();
-            std::vector<int> waterHeights;
-            waterHeights.reserve(sx*sz);
-
-            // Gather all water block heights in the box
-            for (int iz = 0; iz < sz; iz++) {
-                for (int ix = 0; ix < sx; ix++) {
-                    int bx = ix;
-                    int bz = iz;
-                    int colindex = getColumnIndex(bx, bz, sx);
-                    int by = columns[colindex];
-                    int index = getBlockIndex(bx, by, bz, sx, sxz);
-                    unsigned int &cv = cblocks[index];
-                    int c = cv & 0xFF;
-
-                    if (c == Classification::WATER) {
-                        waterHeights.push_back(by);
-                        if (by < minHeight) minHeight = by;
-                    }
-                }
+            // Histogram of the heights of the water columns in the box
+            std::vector<int> waterHeights(sy, 0);
+            int waterNum = 0;
+            for (int colindex = 0; colindex < sxz; colindex++) {
+                int by = columns[colindex];
+                if (classes.get(colindex, by) != Classification::WATER) continue;
+                waterHeights[by]++;
+                waterNum++;
             }
 
             int surfy = -1;
-            if (waterHeights.size() > 0) {
+            if (waterNum > 0) {
                 // Get the median height of a water block
-                std::nth_element(waterHeights.begin(), waterHeights.begin() + waterHeights.size() / 2, waterHeights.end());
-                int medHeight = waterHeights[waterHeights.size() / 2];
-                surfy = medHeight;
+                int medIndex = waterNum / 2;
+                int below = 0;
+                for (surfy = 0; below + waterHeights[surfy] <= medIndex; surfy++) {
+                    below += waterHeights[surfy];
+                }
             }
 
             if (surfy != -1) {
@@ -3623,34 +7246,34 @@ BoxResult& getBox(const BoxType type, const uint32_t worldHash, Vec origin, cons
                 waterSurfaceLevel = surfy;
 
                 // Adjust all water blocks towards the water level
-                for (int iz = 0; iz < sz; iz++) {
-                    for (int ix = 0; ix < sx; ix++) {
+                runBoxRows(sz, [&](int fromZ, int toZ) {
+                    for (int iz = fromZ; iz < toZ; iz++) {
+                        for (int ix = 0; ix < sx; ix++) {
 
-                        int bx = ix;
-                        int bz = iz;
-                        int colindex = getColumnIndex(bx, bz, sx);
-                        unsigned int &by = columns[colindex];
-                        int index = getBlockIndex(bx, by, bz, sx, sxz);
-                        unsigned int &cv = cblocks[index];
-                        int c = cv & 0xFF;
+                            int bx = ix;
+                            int bz = iz;
+                            int colindex = getColumnIndex(bx, bz, sx);
+                            unsigned int &by = columns[colindex];
+                            int c = classes.get(colindex, by);
 
-                        if (c != Classification::WATER) {
-                            continue;
-                        }
+                            if (c != Classification::WATER) {
+                                continue;
+                            }
 
-                        //if (by != ay) {
-                        int step = static_cast<int>(by) < surfy ? 1 : -1;
-                        for (int iy = by; iy != surfy; iy += step) {
-                            cblocks[getBlockIndex(bx, iy, bz, sx, sxz)] = Classification::NONE;
-                            //applyBlockToCloud(bounds_tl, ax, iy, az, Classification::NONE, &all);
-                        }
-                        cblocks[getBlockIndex(bx, surfy, bz, sx, sxz)] = Classification::WATER;
+                            // Clear the blocks between the column height and the surface
+                            if (static_cast<int>(by) < surfy) {
+                                classes.fill(colindex, by, surfy, Classification::NONE);
+                            } else {
+                                classes.fill(colindex, surfy + 1, by + 1, Classification::NONE);
+                            }
+                            classes.set(colindex, surfy, Classification::WATER);
 
-                        // Fix column height
-                        by = surfy;
+                            // Fix column height
+                            by = surfy;
 
+                        }
                     }
-                }
+                });
             }
         }
 
@@ -3665,85 +7288,122 @@ BoxResult& getBox(const BoxType type, const uint32_t worldHash, Vec origin, cons
 
                 int by = waterSurfaceLevel;
 
+                // Depth is the chessboard distance to the closest shore, the
+                // closest column without water at the surface in the box,
+                // measured before any column is deepened
+                const int maxDist = (int)waterMaxDepth;
+                std::vector<int> depths(sxz, 0);
+                for (int colindex = 0; colindex < sxz; colindex++) {
+                    if (classes.get(colindex, by) == Classification::WATER) depths[colindex] = maxDist;
+                }
+
+                // Exact in two passes, each taking the four neighbours
+                // already visited in its own scan order
                 for (int iz = 0; iz < sz; iz++) {
                     for (int ix = 0; ix < sx; ix++) {
-
-                        int bx = ix;
-                        int bz = iz;
-                        int index = getBlockIndex(bx, by, bz, sx, sxz);
-                        unsigned int &cv = cblocks[index];
-                        int c = cv & 0xFF;
-
-                        if (c != Classification::WATER) continue;
-
-                        const int directions = 8;
-                        int dirvec[directions][2] = {
-                            { -1, -1 }, {  0, -1 }, {  1, -1 },
-                            { -1,  0 }, {  1,  0 },
-                            { -1,  1 }, {  0,  1 }, {  1,  1 }
-                        };
-
-                        int maxDist = (int)waterMaxDepth;
-
-                        int shoreDist;
-                        for (shoreDist = 0; shoreDist < maxDist; shoreDist++) {
-                            int* offset = dirvec[(shoreDist * 2) % directions];
-                            int shx = bx + offset[0] * shoreDist;
-                            int shz = bz + offset[1] * shoreDist;
-                            if (shx < 0 || shx >= sx || shz < 0 || shz >= sz) continue;
-                            unsigned int shore = cblocks[getBlockIndex(shx, by, shz, sx, sxz)] & 0xFF;
-                            if (shore != Classification::WATER) {
-                                break;
-                            }
+                        int &depth = depths[getColumnIndex(ix, iz, sx)];
+                        if (depth == 0) continue;
+                        if (ix > 0) depth = std::min(depth, depths[getColumnIndex(ix - 1, iz, sx)] + 1);
+                        if (iz > 0) {
+                            if (ix > 0) depth = std::min(depth, depths[getColumnIndex(ix - 1, iz - 1, sx)] + 1);
+                            depth = std::min(depth, depths[getColumnIndex(ix, iz - 1, sx)] + 1);
+                            if (ix < sx - 1) depth = std::min(depth, depths[getColumnIndex(ix + 1, iz - 1, sx)] + 1);
                         }
-
-                        double depth = shoreDist;
-
-                        //double depth = 1 / (1 + exp(-(shoreDist - maxDist*0.5)*0.3)) * 20;
-
-                        for (int iy = 1; iy < depth; iy++) {
-                            int bdy = by - iy;
-                            if (bdy < 0) break;
-                            cblocks[getBlockIndex(bx, bdy, bz, sx, sxz)] = Classification::WATER;
+                    }
+                }
+                for (int iz = sz - 1; iz >= 0; iz--) {
+                    for (int ix = sx - 1; ix >= 0; ix--) {
+                        int &depth = depths[getColumnIndex(ix, iz, sx)];
+                        if (depth == 0) continue;
+                        if (ix < sx - 1) depth = std::min(depth, depths[getColumnIndex(ix + 1, iz, sx)] + 1);
+                        if (iz < sz - 1) {
+                            if (ix < sx - 1) depth = std::min(depth, depths[getColumnIndex(ix + 1, iz + 1, sx)] + 1);
+                            depth = std::min(depth, depths[getColumnIndex(ix, iz + 1, sx)] + 1);
+                            if (ix > 0) depth = std::min(depth, depths[getColumnIndex(ix - 1, iz + 1, sx)] + 1);
                         }
-
                     }
                 }
+
+                runBoxRows(sz, [&](int fromZ, int toZ) {
+                    for (int iz = fromZ; iz < toZ; iz++) {
+                        for (int ix = 0; ix < sx; ix++) {
+                            int colindex = getColumnIndex(ix, iz, sx);
+                            int depth = depths[colindex];
+                            if (depth > 1) classes.fill(colindex, by - depth + 1, by, Classification::WATER);
+                        }
+                    }
+                });
             }
 
         }
         //*/
 
+    }
 
+    {
+        //                                          //
+        // Classification + custom blocks -> blocks //
+        //                                          //
+        dtimer("transform");
+
+        // Boxes without points only get water and ground, which is already
+        // mapped to blocks in debug mode too
+        bool extend = pointsUsed > 0;
+        bool mapBlocks = !debug || !extend;
+
+        unsigned int classBlocks[256];
+        for (int i = 0; i < 256; i++) {
+            classBlocks[i] = i && mapBlocks ? classificationToBlock(i) : i;
+        }
 
+        // Materialize the runs in the dense y-major layout of the result.
+        // Each z row is first unpacked into a y-major class slice, so the
+        // blocks and column heights of a whole x row are produced at once.
+        blocks.assign(empty ? 0 : sxz*sy, 0);
+        unsigned int *rblocks = blocks.data();
+        if (!empty) runBoxRows(sz, [&](int fromZ, int toZ) {
+            static thread_local std::vector<uint8_t> slice;
+            static thread_local std::vector<int> heights;
+            slice.assign(sx*sy, 0);
+            heights.resize(sx);
+
+            int rowsMinHeight = minHeight;
+            int rowsMaxHeight = maxHeight;
+            for (int bz = fromZ; bz < toZ; bz++) {
+                int sliceFrom = sy;
+                int sliceTo = 0;
+                for (int bx = 0; bx < sx; bx++) {
+                    for (const BlockRun &run : classes.getRuns(getColumnIndex(bx, bz, sx))) {
+                        for (int by = run.from; by < run.to; by++) {
+                            slice[by*sx + bx] = run.classification;
+                        }
+                        sliceFrom = std::min(sliceFrom, (int)run.from);
+                        sliceTo = std::max(sliceTo, (int)run.to);
+                    }
+                }
+                if (sliceFrom >= sliceTo) continue;
+
+                std::fill(heights.begin(), heights.end(), -1);
+                int rowMin = -1;
+                for (int by = sliceFrom; by < sliceTo; by++) {
+                    uint8_t *classRow = &slice[by*sx];
+                    bool solid = mapBlockRow(classRow, sx, classBlocks, &rblocks[getBlockIndex(0, by, bz, sx, sxz)], by, heights.data());
+                    if (solid && rowMin == -1) rowMin = by;
+                    memset(classRow, 0, sx);
+                }
 
-        {
-            //                                          //
-            // Classification + custom blocks -> blocks //
-            //                                          //
-            dtimer("transform");
-
-            // TODO: only use uint8 for cblocks, but then convert into the uint32
-            // shape used below
-            for (int i = 0; i < sxyz; i++) {
-                unsigned int &cv = cblocks[i];
-
-                int bx = i & msx;
-                int bz = (i >> psx) & msz;
-                int by = (i >> psx) >> psz;
-
-                if (cv && !debug) cv = classificationToBlock(cv);
-
-                if (cv > 0) {
+                if (extend && rowMin != -1) {
                     //br.jsonWrite(bx + 0.5, by + 0.5, bz + 0.5, -10);
-                    extendColumn(bx, by, bz, sx, columns.data(), &minHeight, &maxHeight);
+                    if (rowMin < rowsMinHeight) rowsMinHeight = rowMin;
+                    for (int bx = 0; bx < sx; bx++) {
+                        if (heights[bx] >= 0) extendColumn(bx, heights[bx], bz, sx, columns.data(), nullptr, &rowsMaxHeight);
+                    }
                 }
-
-                //c |= (i%0xF) << 16;
             }
-        }
-
-
+            std::lock_guard<std::mutex> lock(heightMutex);
+            minHeight = std::min(minHeight, rowsMinHeight);
+            maxHeight = std::max(maxHeight, rowsMaxHeight);
+        });
     }
 
 
@@ -3769,9 +7429,13 @@ BoxResult& getBox(const BoxType type, const uint32_t worldHash, Vec origin, cons
         br.valid = true;
     }
 
+    // Clouds loaded before their files changed give stale boxes
+    if (!debug && getCornerSourceStamp(cornerClouds) == sourceStamp) boxDisk.write(key, sourceStamp, br);
+    boxCache.update(key, boxRef);
+
     ++boxesCreated;
 
-    return br;
+    return boxRef;
 }
 
 static void sendRawDebug(struct mg_connection *conn, BoxResult &br, const int sx, const int sy, const int sz) {
@@ -3887,14 +7551,16 @@ void GKOTHandleBox(struct mg_connection *conn, void *cbdata, const mg_request_in
         debugPrint("crop to:   %4d %4d %4d\n", cbx, cby, cbz);
     }
     
-    BoxResult &br = getBox(type, worldHash, origin, x, y, z, sx, sy, sz, false, transform);
+    BoxCache::BoxRef boxRef = getBox(type, worldHash, origin, x, y, z, sx, sy, sz, false, transform);
 
-    if (&br == &invalidBoxResult) {
+    if (!boxRef) {
         printf("Invalid box %ld %ld %ld %ld %ld %ld\n", x, y, z, sx, sy, sz);
         mg_send_http_error(conn, 400, "Invalid box");
         return;
     }
 
+    BoxResult &br = *boxRef;
+
     {
         dtimer("send");
 
@@ -4109,7 +7775,9 @@ void GKOTHandleTile(struct mg_connection *conn, void *cbdata, const mg_request_i
 
         dtimer("deserialization");
 
-        BoxResult &br = getBox(BoxType::AMF, 0, default_origin, x, y, z, sx, sy, sz, true, false);
+        BoxCache::BoxRef boxRef = getBox(BoxType::AMF, 0, default_origin, x, y, z, sx, sy, sz, true, false);
+        vassert(boxRef, "Invalid box %ld %ld %ld %ld %ld %ld", x, y, z, sx, sy, sz);
+        BoxResult &br = *boxRef;
 
         br.decompress();
 
@@ -4528,8 +8196,8 @@ void GKOTHandleDebugBoxes(struct mg_connection *conn, void *cbdata, const mg_req
     int mw = mapTileWidth;
     int mh = mapTileHeight;
 
-    PointCloud all(50);
-    PointCloud ground(20);
+    PointCloud all;
+    PointCloud ground;
 
     mc->load(&all, &ground);
 
@@ -4541,7 +8209,7 @@ void GKOTHandleDebugBoxes(struct mg_connection *conn, void *cbdata, const mg_req
     int count = 0;
     size_t pointNum = all.getPointNum();
     for (size_t i = 0; i < pointNum; i++) {
-        Point &p = all.getPoint(i);
+        Point p = all.getPoint(i);
         int bx, by, bz;
         getBlockFromCoords(origin, p, bx, by, bz);
         int index = getBlockIndex(bx, 0, bz, mw, mw*mh);
@@ -4704,8 +8372,8 @@ void DOF84HandleDebug(struct mg_connection *conn, void *cbdata, const mg_request
     int mw = mapTileWidth;
     int mh = mapTileHeight;
 
-    PointCloud all(50);
-    PointCloud ground(20);
+    PointCloud all;
+    PointCloud ground;
 
     mc->load(&all, &ground);
 
@@ -4720,7 +8388,7 @@ void DOF84HandleDebug(struct mg_connection *conn, void *cbdata, const mg_request
     int count = 0;
     size_t pointNum = all.getPointNum();
     for (size_t i = 0; i < pointNum; i++) {
-        Point &p = all.getPoint(i);
+        Point p = all.getPoint(i);
         int bx, by, bz;
         getBlockFromCoords(origin, p, bx, by, bz);
         if (bx < 0 || bz < 0 || bx >= mw || bz >= mh) continue;
@@ -4883,29 +8551,50 @@ enum OptionIndex {
     LIDAR,
     MAP,
     BDMR,
+    STORE,
     FISHNET,
     ORIGIN,
     CACHE,
+    INDEX,
     MAP_MEMORY_LIMIT,
+    TREE_MEMORY_LIMIT,
+    READERS,
+    WORKERS,
+    POINT_CACHE,
+    DECODE_THREADS,
+    TREES,
+    PARALLEL_BOXES,
     TRANSFORM_THRESHOLD,
     TRANSFORM_SCALE_BELOW,
     TRANSFORM_SCALE_ABOVE,
+    BOX_DISK,
 };
 
 const option::Descriptor usage[] =
 {
-    { UNKNOWN, 0, "",  "",      option::Arg::None,     "USAGE: voxelserver [options] [root-path-to-gis-data]\n\n"
+    { UNKNOWN, 0, "",  "",      option::Arg::None,     "USAGE: voxelserver [bake] [options] [root-path-to-gis-data]\n\n"
+    "  bake  \tPreprocess all fishnet sections (LAS indices, point stores, trees, statistics) and exit.\n\n"
     "Options:" },
     { HELP,    0, "h", "help",    option::Arg::None,     "  --help, -h  \tPrint usage and exit." },
     { PORT,    0, "p", "port",    option::Arg::Optional, "  --port, -p  \tServer listening port number." },
     { LIDAR,   0, "l", "lidar",   option::Arg::Optional, "  --lidar, -l  \tPath to the LIDAR sections directory in GKOT format." },
     { MAP,     0, "m", "map",     option::Arg::Optional, "  --map, -m  \tPath to the map sections directory in DOF84 format." },
     { BDMR,    0, "r", "bdmr",    option::Arg::Optional, "  --bdmr, -r  \tPath to the binary digital relief model sections directory." },
+    { STORE,   0, "s", "store",   option::Arg::Optional, "  --store, -s  \tPath to the decoded point store directory, built from LIDAR sections by bake." },
     { FISHNET, 0, "d", "fishnet", option::Arg::Optional, "  --fishnet, -d  \tPath to the fishnet database of sections." },
     { WWW,     0, "w", "www",     option::Arg::Optional, "  --www, -w  \tPath to the directory containing web files." },
     { ORIGIN,  0, "o", "origin",  option::Arg::Optional, "  --origin, -o  \tD96/TM coordinates of the box origin." },
-    { CACHE,    0, "c", "cache",  option::Arg::Optional, "  --cache, -c  \tCache hash size power, default 14." },
+    { CACHE,    0, "c", "cache",  option::Arg::Optional, "  --cache, -c  \tBox cache limit in megabytes, default 1024." },
+    { INDEX,    0, "x", "index",  option::Arg::None,     "  --index, -x  \tBuild missing or outdated LAS spatial indices (.lax) for all fishnet sections before serving." },
     { MAP_MEMORY_LIMIT, 0, "t", "map-memory", option::Arg::Optional, "  --map-memory, -t  \tMap memory limit in megabytes." },
+    { TREE_MEMORY_LIMIT, 0, "", "tree-memory", option::Arg::Optional, "  --tree-memory  \tSection tree memory limit in megabytes, default 2000." },
+    { READERS, 0, "", "readers", option::Arg::Optional, "  --readers  \tNumber of LIDAR readers kept open per section, default 6." },
+    { WORKERS, 0, "", "workers", option::Arg::Optional, "  --workers  \tNumber of worker threads shared by box requests, default is the number of cores." },
+    { POINT_CACHE, 0, "", "point-cache", option::Arg::Optional, "  --point-cache  \tDecoded LIDAR point cache limit in megabytes, 0 to disable, default 256." },
+    { BOX_DISK, 0, "", "box-disk", option::Arg::Optional, "  --box-disk  \tLimit in megabytes of the boxes kept in the store directory across restarts, 0 to disable, default 0." },
+    { DECODE_THREADS, 0, "", "decode-threads", option::Arg::Optional, "  --decode-threads  \tNumber of readers decoding the chunks of one LIDAR section read in parallel, default 4." },
+    { TREES, 0, "", "trees", option::Arg::Optional, "  --trees  \tSearch box points through persisted per-section kd-trees built next to the point stores by bake, 0 to disable, default 1." },
+    { PARALLEL_BOXES, 0, "", "parallel-boxes", option::Arg::Optional, "  --parallel-boxes  \tSplit the processing stages of one box over the workers, the output is the same as serial, 0 to disable, default 1." },
     { TRANSFORM_THRESHOLD, 0, "", "transform-threshold", option::Arg::Optional, "  --transform-threshold  \tHeight threshold of the point input transform." },
     { TRANSFORM_SCALE_BELOW, 0, "", "transform-scale-below", option::Arg::Optional, "  --transform-scale-below  \tHeight scale below the transform threshold." },
     { TRANSFORM_SCALE_ABOVE, 0, "", "transform-scale-above", option::Arg::Optional, "  --transform-scale-above  \tHeight scale above the transform threshold." },
@@ -4913,6 +8602,7 @@ const option::Descriptor usage[] =
     { UNKNOWN, 0, "",  "",        option::Arg::None,     "\nExamples:\n"
                                                          "  voxelserver\n"
                                                          "  voxelserver --port=8989 W:/gis/arso/\n"
+                                                         "  voxelserver bake --workers=8 W:/gis/arso/\n"
                                                          "  voxelserver -o\"461777 101414 200\" W:/gis/arso/\n"
     },
     { 0,0,0,0,0,0 }
@@ -4993,8 +8683,44 @@ int main(int argc, char const* argv[])
         vassert(src.z == dst.z, "Block transformation test failed for Z");
     }
 
-    std::string port, path, gkotAbsPath, dof84AbsPath, bdmrAbsPath;
-    int hashPower;
+    {
+        const char *kernelName = selectBlockRowKernel();
+
+        unsigned int table[256];
+        for (int i = 0; i < 256; i++) table[i] = i ? classificationToBlock(i) : 0;
+
+        const int n = 61;
+        uint8_t row[n];
+        for (int i = 0; i < n; i++) row[i] = (i*i*37 + i*11) % 3 == 0 ? 0 : (uint8_t)((i*97 + 13) & 0xFF);
+
+        unsigned int expectedBlocks[n];
+        int expectedHeights[n];
+        for (int i = 0; i < n; i++) expectedHeights[i] = i % 5 - 1;
+        bool expectedAny = mapBlockRowScalar(row, n, table, expectedBlocks, 42, expectedHeights);
+
+        struct { const char *name; BlockRowKernel kernel; bool available; } kernels[] = {
+            { "SSE4.1", mapBlockRowSse41, cpuHasSse41() },
+            { "AVX2", mapBlockRowAvx2, cpuHasAvx2() },
+        };
+        for (const auto &k : kernels) {
+            if (!k.available) continue;
+            unsigned int actualBlocks[n];
+            int actualHeights[n];
+            for (int i = 0; i < n; i++) actualHeights[i] = i % 5 - 1;
+            bool actualAny = k.kernel(row, n, table, actualBlocks, 42, actualHeights);
+
+            vassert(expectedAny == actualAny, "Block row kernel test failed for %s", k.name);
+            for (int i = 0; i < n; i++) {
+                vassert(expectedBlocks[i] == actualBlocks[i], "Block row kernel test failed for %s blocks", k.name);
+                vassert(expectedHeights[i] == actualHeights[i], "Block row kernel test failed for %s heights", k.name);
+            }
+        }
+
+        plog("Block row kernel: %s", kernelName);
+    }
+
+    std::string port, path, gkotAbsPath, dof84AbsPath, bdmrAbsPath, storeAbsPath;
+    int boxCacheLimit;
 
     argc -= (argc>0); argv += (argc>0); // skip program name argv[0] if present
     option::Stats  stats(usage, argc, argv);
@@ -5015,8 +8741,12 @@ int main(int argc, char const* argv[])
         std::cout << " Unknown option: " << opt->name << std::endl;
     if (options[UNKNOWN]) std::cout << std::endl;
 
-    path = parse.nonOptionsCount() > 0 ? parse.nonOption(0) : defaultPath;
-    for (int i = 1; i < parse.nonOptionsCount(); ++i) {
+    int nonOptionIndex = 0;
+    bool bake = parse.nonOptionsCount() > 0 && strcmp(parse.nonOption(0), "bake") == 0;
+    if (bake) nonOptionIndex++;
+
+    path = parse.nonOptionsCount() > nonOptionIndex ? parse.nonOption(nonOptionIndex) : defaultPath;
+    for (int i = nonOptionIndex + 1; i < parse.nonOptionsCount(); ++i) {
         std::cout << "Unknown argument: " << parse.nonOption(i) << "\n";
     }
 
@@ -5026,37 +8756,79 @@ int main(int argc, char const* argv[])
     gkotAbsPath = getPathOption(&options[0], path, LIDAR, gkotRel);
     dof84AbsPath = getPathOption(&options[0], path, MAP, dof84Rel);
     bdmrAbsPath = getPathOption(&options[0], path, BDMR, bdmrRel);
+    storeAbsPath = getPathOption(&options[0], path, STORE, storeRel);
     fishnetPath = getPathOption(&options[0], path, FISHNET, fishnetRel);
     webPath = getPathOption(&options[0], path, WWW, webRel);
     default_origin = getCoordsOption(&options[0], ORIGIN, default_origin);
-    hashPower = options[CACHE] ? atoi(options[CACHE].arg) : defaultPower;
-    vassert(hashPower > 0, "Hash power should be greater than zero: %d", hashPower);
+    boxCacheLimit = options[CACHE] ? atoi(options[CACHE].arg) : defaultBoxCacheLimit;
+    vassert(boxCacheLimit > 0, "Box cache limit should be greater than zero: %d", boxCacheLimit);
+    boxCache.setLimit(static_cast<size_t>(boxCacheLimit) * 1024 * 1024);
     mapMemoryLimit = options[MAP_MEMORY_LIMIT] ? atoi(options[MAP_MEMORY_LIMIT].arg) : defaultMapMemoryLimit;
     vassert(mapMemoryLimit > 0, "Map memory limit should be greater than zero: %d", mapMemoryLimit);
+    treeMemoryLimit = options[TREE_MEMORY_LIMIT] ? atoi(options[TREE_MEMORY_LIMIT].arg) : defaultTreeMemoryLimit;
+    vassert(treeMemoryLimit > 0, "Tree memory limit should be greater than zero: %d", treeMemoryLimit);
+    readerNum = options[READERS] ? atoi(options[READERS].arg) : defaultReaderNum;
+    vassert(readerNum > 0, "Reader number should be greater than zero: %d", readerNum);
+    int pointCacheLimit = options[POINT_CACHE] ? atoi(options[POINT_CACHE].arg) : defaultPointCacheLimit;
+    vassert(pointCacheLimit >= 0, "Point cache limit should not be negative: %d", pointCacheLimit);
+    pointCache.setLimit(static_cast<size_t>(pointCacheLimit) * 1024 * 1024);
+    int boxDiskLimit = options[BOX_DISK] ? atoi(options[BOX_DISK].arg) : defaultBoxDiskLimit;
+    vassert(boxDiskLimit >= 0, "Box disk limit should not be negative: %d", boxDiskLimit);
+    decodeThreads = options[DECODE_THREADS] ? atoi(options[DECODE_THREADS].arg) : defaultDecodeThreads;
+    vassert(decodeThreads > 0, "Decode thread number should be greater than zero: %d", decodeThreads);
+    useTrees = options[TREES] ? atoi(options[TREES].arg) != 0 : defaultUseTrees;
+    parallelBoxes = options[PARALLEL_BOXES] ? atoi(options[PARALLEL_BOXES].arg) != 0 : defaultParallelBoxes;
+    int workerNum = options[WORKERS] ? atoi(options[WORKERS].arg) : std::max(1, static_cast<int>(std::thread::hardware_concurrency()));
+    vassert(workerNum >= 0, "Worker number should not be negative: %d", workerNum);
     transformThreshold = options[TRANSFORM_THRESHOLD] ? atof(options[TRANSFORM_THRESHOLD].arg) : defaultTransformThreshold;
     transformScaleBelow = options[TRANSFORM_SCALE_BELOW] ? atof(options[TRANSFORM_SCALE_BELOW].arg) : defaultTransformScaleBelow;
     transformScaleAbove = options[TRANSFORM_SCALE_ABOVE] ? atof(options[TRANSFORM_SCALE_ABOVE].arg) : defaultTransformScaleAbove;
 
 
-    boxHash.resize(hashPower);
-
     gkotFullFormat = gkotAbsPath + "/" + gkotFormat;
     dof84FullFormat = dof84AbsPath + "/" + dof84Format;
     bdmrFullFormat = bdmrAbsPath + "/" + bdmrFormat;
+    storeFullFormat = storeAbsPath + "/" + storeFormat;
+    statsFullFormat = storeAbsPath + "/" + statsFormat;
+    treeFullFormat = storeAbsPath + "/" + treeFormat;
 
     plog("Lidar (gkot) path: %s", gkotAbsPath.c_str());
     plog("Map (dof84) path: %s", dof84AbsPath.c_str());
     plog("BDMR path: %s", bdmrAbsPath.c_str());
+    plog("Point store path: %s", storeAbsPath.c_str());
     plog("Web files path: %s", webPath.c_str());
     plog("Fishnet database: %s", fishnetPath.c_str());
     plog("Default origin coordinates: %g, %g, %g", default_origin.x(), default_origin.y(), default_origin.z());
-    plog("Box cache size: %d", boxHash.size);
+    plog("Box cache limit: %d MB", boxCacheLimit);
+    plog("Box disk limit: %d MB", boxDiskLimit);
     plog("Map memory limit: %d MB", mapMemoryLimit);
+    plog("Tree memory limit: %d MB", treeMemoryLimit);
+    plog("Readers per section: %d", readerNum);
+    plog("Point cache limit: %d MB", pointCacheLimit);
+    plog("Decode threads per section: %d", decodeThreads);
+    plog("Section trees: %s", useTrees ? "enabled" : "disabled");
+    plog("Parallel boxes: %s", parallelBoxes ? "enabled" : "disabled");
+    plog("Worker threads: %d", workerNum);
     plog("Transform: threshold %g scale below %g scale above %g", transformThreshold, transformScaleBelow, transformScaleAbove);
     
     bool dbLoaded = fishnet.load(fishnetPath.c_str());
     vassert(dbLoaded, "Unable to open fishnet database: %s", fishnetPath.c_str());
 
+    workers.start(workerNum);
+
+    plog("Classification cubes: %d", getClassificationCubes()->getCubeNum());
+
+    if (bake) {
+        bakeSections();
+        return EXIT_SUCCESS;
+    }
+
+    if (options[INDEX]) indexSections();
+
+    if (boxDiskLimit > 0) {
+        boxDisk.open(storeAbsPath + "/" + boxDiskRel, static_cast<uint64_t>(boxDiskLimit) * 1024 * 1024);
+    }
+
     const char *serverOptions[] = {
         "listening_ports", port.c_str(),
         "request_timeout_ms", "10000",